@@ -40,7 +40,7 @@ namespace Actors
                           Logger::debug() << "Auto closing door ...";})));
 
     public:
-        SMachine(): Actor("SMACHINE") {}
+        SMachine(): Actor("SMACHINE", ExecutionMode::MAILBOX) {}
         ~SMachine() override = default;
     }; // SMachine
 } // Actors
@@ -21,16 +21,18 @@
 #include <mutex>
 #include <functional>
 #include <string>
+#include <type_traits>
 #include <rxcpp/rx.hpp>
 #include "Memory.h"
 #include "Logger.h"
 #include "Message.h"
 #include "Dispatcher.h"
 #include "Scheduler.h"
+#include "Runtime.h"
 #include "Timer.h"
 #include "StateMachine.h"
 
-#define STATEMACHINE(...) StateMachine_t(new StateMachines::StateMachine(Actor::actorMutex, __VA_ARGS__))
+#define STATEMACHINE(...) StateMachine_t(new StateMachines::StateMachine(Actor::context, __VA_ARGS__))
 #define STATE(...) new StateMachines::State(__VA_ARGS__)
 #define TIMER(...) new StateMachines::TimerTransition(__VA_ARGS__)
 #define MESSAGE(...) new StateMachines::MessageTransition(__VA_ARGS__)
@@ -47,19 +49,22 @@ namespace Actors
     typedef Schedulers::JobId_t JobId_t;
     typedef std::shared_ptr<Timers::Timer> Timer_t;
     typedef std::shared_ptr<StateMachines::StateMachine> StateMachine_t;
+    typedef Dispatchers::ExecutionMode ExecutionMode;
+    typedef Dispatchers::Priority Priority;
+    typedef Schedulers::RepeatMode RepeatMode;
 
     class Messenger
     {
     private:
         bool& markedForDeletion;
-        std::mutex& actorMutex;
+        Dispatchers::ActorContext& context;
 
     protected:
         std::mutex subscriptionsMutex;
         std::map<SubscriptionId_t, Message_t> subscriptions;
 
     public:
-        explicit Messenger(bool& markedForDeletion, std::mutex& actorMutex): markedForDeletion(markedForDeletion), actorMutex(actorMutex) {};
+        explicit Messenger(bool& markedForDeletion, Dispatchers::ActorContext& context): markedForDeletion(markedForDeletion), context(context) {};
         virtual ~Messenger() = default;
 
         SubscriptionId_t subscribe(Message_t type, const DispatcherFunction_t& func) {
@@ -67,23 +72,70 @@ namespace Actors
             for (const auto& sub: subscriptions)
                 assert(sub.second != type);
             auto fn = [this, func](Message* msg){
-                std::unique_lock<std::mutex> lock(actorMutex);
+                auto lock = context.lock();
                 if (!markedForDeletion)
                     func(msg);};
-            auto subId = Dispatchers::Dispatcher::getInstance().registerCB(fn, type);
+            auto subId = context.getDispatcher().registerCB(fn, type, context.getMailbox()); // Messages to an Actor are handled in FIFO order.
             subscriptions[subId] = type;
             return subId;
         }
 
+        // Subscribes to messages of any type T published by publish<T>(...). The handler takes a const T& as argument.
+        template<typename T, typename Handler>
+        SubscriptionId_t subscribe(Handler handler) {
+            static_assert(!std::is_base_of<Message, T>::value, "Messages derived from Message are subscribed by their Message_t.");
+            return subscribe(msgTypeOf<T>(), [handler](Message* msg) {
+                handler(static_cast<TypedMsg<T>*>(msg)->get());});
+        }
+
         void unsubscribe(const SubscriptionId_t subId) {
             std::unique_lock<std::mutex> lock(subscriptionsMutex);
             auto type = subscriptions[subId];
-            Dispatchers::Dispatcher::getInstance().unregisterCB(subId, type);
+            context.getDispatcher().unregisterCB(subId, type);
             subscriptions.erase(subId);
         }
 
-        static void publish(Message* msg) {
-            Dispatchers::Dispatcher::getInstance().publish(msg);
+        // Messages are published in the runtime of the Actor whose callback the calling thread executes, otherwise in the
+        // default runtime, i.e. also code outside of Actors can publish. Actors publish in their own runtime by publish(...).
+        static bool publish(Message* msg) {
+            return Dispatchers::Dispatcher::getCurrent().publish(msg);
+        }
+
+        // Overrides the priority of the message type for this message only.
+        static bool publish(Message* msg, Priority priority) {
+            return Dispatchers::Dispatcher::getCurrent().publish(msg, priority);
+        }
+
+        template<typename T>
+        static bool publish(const MessagePtr<T>& msg) {
+            return Dispatchers::Dispatcher::getCurrent().publish(msg.get());
+        }
+
+        // Publishes a message of type T constructed from args.
+        template<typename T, typename ... Args>
+        static bool publish(Args&&... args) {
+            static_assert(!std::is_base_of<Message, T>::value, "Messages derived from Message are published by publish(new T(...)).");
+            return Dispatchers::Dispatcher::getCurrent().publish(new TypedMsg<T>(std::forward<Args>(args)...));
+        }
+
+        // Publishes a message of type T constructed in the message pool from args, i.e. without a heap allocation.
+        // T may be a subclass of Message or any other type, in which case it is published as a typed message.
+        template<typename T, typename ... Args>
+        static bool emplace_publish(Args&&... args) {
+            return Dispatchers::Dispatcher::getCurrent().publish(newPooledMsg<T>(std::forward<Args>(args)...));
+        }
+
+        template<typename Iterator, typename = std::enable_if_t<std::is_convertible<decltype(*std::declval<Iterator>()), Message*>::value>>
+        static std::size_t publish(Iterator first, Iterator last) {
+            return Dispatchers::Dispatcher::getCurrent().publish(first, last);
+        }
+
+        static std::size_t publish(std::initializer_list<Message*> msgs) {
+            return Dispatchers::Dispatcher::getCurrent().publish(msgs.begin(), msgs.end());
+        }
+
+        static std::size_t publish(const std::vector<Message*>& msgs) {
+            return Dispatchers::Dispatcher::getCurrent().publish(msgs.begin(), msgs.end());
         }
 
         auto stream(Message_t type) {
@@ -100,22 +152,24 @@ namespace Actors
     {
     private:
         bool& markedForDeletion;
-        std::mutex& actorMutex;
+        Dispatchers::ActorContext& context;
 
     protected:
         std::mutex scheduledJobsMutex;
         std::list<JobId_t> scheduledJobs;
 
     public:
-        explicit Scheduler(bool& markedForDeletion, std::mutex& actorMutex): markedForDeletion(markedForDeletion), actorMutex(actorMutex) {};
+        explicit Scheduler(bool& markedForDeletion, Dispatchers::ActorContext& context): markedForDeletion(markedForDeletion), context(context) {};
         virtual ~Scheduler() = default;
 
-        JobId_t once(std::chrono::duration<long, std::milli> msec, const SchedulerFunction_t& func) {
+        template<typename Rep, typename Period>
+        JobId_t once(std::chrono::duration<Rep, Period> timeout, const SchedulerFunction_t& func) {
             std::unique_lock<std::mutex> lock(scheduledJobsMutex);
-            auto jobId = Schedulers::Scheduler::getInstance().onceIn(msec, [this, func](){
-                std::unique_lock<std::mutex> lock(actorMutex);
+            auto mailbox = context.getMailbox(); // The timer may expire while the Actor is deleted.
+            auto job = context.wrap([this, func]() {
                 if (!markedForDeletion)
                     func();});
+            auto jobId = context.getTimers().onceIn(timeout, [mailbox, job]() {mailbox->postExpired(job);});
             scheduledJobs.push_back(jobId); // Used by destructor to remove subscriptions
             return jobId;
         }
@@ -124,32 +178,53 @@ namespace Actors
             return once(std::chrono::duration<long, std::milli>(msec), func);
         }
 
-        JobId_t repeat(std::chrono::duration<long, std::milli> msec, const SchedulerFunction_t& func) {
+        // With RepeatMode::FIXED_DELAY the period is counted from when the Actor has executed func.
+        template<typename Rep, typename Period>
+        JobId_t repeat(std::chrono::duration<Rep, Period> period, const SchedulerFunction_t& func, RepeatMode mode = RepeatMode::FIXED_RATE_BURST) {
             std::unique_lock<std::mutex> lock(scheduledJobsMutex);
-            auto jobId = Schedulers::Scheduler::getInstance().repeatEvery(msec, [this, func](){
-                std::unique_lock<std::mutex> lock(actorMutex);
+            auto mailbox = context.getMailbox(); // The timer may expire while the Actor is deleted.
+            auto& timers = context.getTimers(); // Outlives the Actor.
+            auto job = context.wrap([this, func]() {
                 if (!markedForDeletion)
                     func();});
+            JobId_t jobId;
+            if (mode == RepeatMode::FIXED_DELAY)
+                jobId = timers.repeatAfter(period, [mailbox, job, &timers](JobId_t jobId){
+                    mailbox->postExpired([job, &timers, jobId]() { // Dropped when the Actor is deleted, the job is removed by then.
+                        job();
+                        timers.rearm(jobId);});});
+            else
+                jobId = timers.repeatEvery(period, [mailbox, job](){mailbox->postExpired(job);}, mode);
             scheduledJobs.push_back(jobId); // Used by destructor to remove subscriptions
             return jobId;
         }
 
-        JobId_t repeat(long msec, const SchedulerFunction_t& func) {
-            return repeat(std::chrono::duration<long, std::milli>(msec), func);
+        JobId_t repeat(long msec, const SchedulerFunction_t& func, RepeatMode mode = RepeatMode::FIXED_RATE_BURST) {
+            return repeat(std::chrono::duration<long, std::milli>(msec), func, mode);
+        }
+
+        Schedulers::JobStats stats(JobId_t jobId) {
+            return context.getTimers().getStats(jobId);
+        }
+
+        // The timeouts of the job may be delayed up to slack, so that they can be handled together with timeouts of other jobs.
+        template<typename Rep, typename Period>
+        void slack(JobId_t jobId, std::chrono::duration<Rep, Period> slack) {
+            context.getTimers().setSlack(jobId, slack);
         }
 
         void remove(JobId_t jobId) {
             std::unique_lock<std::mutex> lock(scheduledJobsMutex);
-            Schedulers::Scheduler::getInstance().removeJob(jobId);
+            context.getTimers().removeJob(jobId);
             scheduledJobs.remove(jobId); // Used by destructor to remove subscriptions
         }
 
         Timer_t timer(std::chrono::duration<long, std::milli> msec, const SchedulerFunction_t& func) {
-            return Timer_t(new Timers::Timer(actorMutex, msec, func));
+            return Timer_t(new Timers::Timer(context, msec, func));
         }
 
         Timer_t timer(long msec, const SchedulerFunction_t& func) {
-            return Timer_t (new Timers::Timer(actorMutex, msec, func));
+            return Timer_t (new Timers::Timer(context, msec, func));
         }
     }; // Scheduler
 
@@ -170,29 +245,69 @@ namespace Actors
     }; // Logger
 
 
-    class Actor: public MemoryManagement::Memory, public Messenger, public Scheduler, public Logger
+    class Actor: public MemoryManagement::SubsystemMemory<MemoryManagement::ACTORS>, public Messenger, public Scheduler, public Logger
     {
     protected:
         bool markedForDeletion = false;
-        std::mutex actorMutex;
+        Dispatchers::ActorContext context;
         std::string actorName;
 
     public:
-        explicit Actor(const std::string& name): Messenger(markedForDeletion, actorMutex), Scheduler(markedForDeletion,actorMutex), Logger(name), markedForDeletion(false), actorName(name) {}
+        // The Actor belongs to the runtime until it is deleted.
+        Actor(Runtimes::Runtime& runtime, const std::string& name, ExecutionMode mode = ExecutionMode::LOCKED): Messenger(markedForDeletion, context), Scheduler(markedForDeletion, context), Logger(name), markedForDeletion(false), context(runtime.getDispatcher(), mode), actorName(name) {}
+        explicit Actor(const std::string& name, ExecutionMode mode = ExecutionMode::LOCKED): Actor(Runtimes::Runtime::getDefault(), name, mode) {}
 
         ~Actor() override {
             markedForDeletion = true;
 
             std::unique_lock<std::mutex> scheduledJobsLock(scheduledJobsMutex);
             for (const auto jobId: scheduledJobs)
-                Schedulers::Scheduler::getInstance().removeJob(jobId);
+                context.getTimers().removeJob(jobId);
             scheduledJobs.clear();
 
             std::unique_lock<std::mutex> subscriptionsLock(subscriptionsMutex);
             for (const auto& sub: subscriptions)
-                Dispatchers::Dispatcher::getInstance().unregisterCB(sub.first, sub.second);
+                context.getDispatcher().unregisterCB(sub.first, sub.second);
             subscriptions.clear();
         }
+
+        // Messages are published in the runtime of the Actor, also from its constructor. Hides the static Messenger::publish(...).
+        bool publish(Message* msg) {
+            return context.getDispatcher().publish(msg);
+        }
+
+        bool publish(Message* msg, Priority priority) {
+            return context.getDispatcher().publish(msg, priority);
+        }
+
+        template<typename T>
+        bool publish(const MessagePtr<T>& msg) {
+            return context.getDispatcher().publish(msg.get());
+        }
+
+        template<typename T, typename ... Args>
+        bool publish(Args&&... args) {
+            static_assert(!std::is_base_of<Message, T>::value, "Messages derived from Message are published by publish(new T(...)).");
+            return context.getDispatcher().publish(new TypedMsg<T>(std::forward<Args>(args)...));
+        }
+
+        template<typename T, typename ... Args>
+        bool emplace_publish(Args&&... args) {
+            return context.getDispatcher().publish(newPooledMsg<T>(std::forward<Args>(args)...));
+        }
+
+        template<typename Iterator, typename = std::enable_if_t<std::is_convertible<decltype(*std::declval<Iterator>()), Message*>::value>>
+        std::size_t publish(Iterator first, Iterator last) {
+            return context.getDispatcher().publish(first, last);
+        }
+
+        std::size_t publish(std::initializer_list<Message*> msgs) {
+            return context.getDispatcher().publish(msgs.begin(), msgs.end());
+        }
+
+        std::size_t publish(const std::vector<Message*>& msgs) {
+            return context.getDispatcher().publish(msgs.begin(), msgs.end());
+        }
     }; // Actor
 } // Actors
 
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2023, Henrik Larsen
+ * https://github.com/henrik7264/CPP_Actors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPP_ACTORS_CPU_H
+#define CPP_ACTORS_CPU_H
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+namespace Cpus
+{
+    typedef std::vector<unsigned int> CpuSet_t; // Empty: all CPUs.
+
+    inline unsigned int noOfCpus() {
+        unsigned int cores = std::thread::hardware_concurrency();
+        if (cores == 0)
+            cores = 4;
+        return cores;
+    }
+
+    // Parses a Linux CPU list like "0-3,8,10-11".
+    inline CpuSet_t parseCpuList(const std::string& list) {
+        CpuSet_t cpus;
+        std::stringstream stream(list);
+        std::string range;
+        while (std::getline(stream, range, ',')) {
+            auto dash = range.find('-');
+            try {
+                auto first = static_cast<unsigned int>(std::stoul(range.substr(0, dash)));
+                auto last = dash == std::string::npos ? first : static_cast<unsigned int>(std::stoul(range.substr(dash + 1)));
+                for (auto cpu = first; cpu <= last; cpu++)
+                    cpus.push_back(cpu);
+            }
+            catch (const std::exception&) {} // Empty or malformed ranges are ignored.
+        }
+        return cpus;
+    }
+
+    // Number of NUMA nodes, 1 if unknown.
+    inline unsigned int noOfNodes() {
+        unsigned int nodes = 0;
+        while (std::ifstream("/sys/devices/system/node/node" + std::to_string(nodes) + "/cpulist"))
+            nodes++;
+        return nodes == 0 ? 1 : nodes;
+    }
+
+    // The CPUs of a NUMA node. Empty if unknown.
+    inline CpuSet_t cpusOfNode(unsigned int node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        std::getline(file, list);
+        return parseCpuList(list);
+    }
+
+    // The NUMA node of a CPU, 0 if unknown. The topology is read once.
+    inline unsigned int nodeOfCpu(unsigned int cpu) {
+        static const std::vector<unsigned int> nodes = []() {
+            std::vector<unsigned int> nodeOf;
+            for (unsigned int node = 0, n = noOfNodes(); node < n; node++)
+                for (auto cpuOfNode: cpusOfNode(node)) {
+                    if (cpuOfNode >= nodeOf.size())
+                        nodeOf.resize(cpuOfNode + 1, 0);
+                    nodeOf[cpuOfNode] = node;
+                }
+            return nodeOf;
+        }();
+        return cpu < nodes.size() ? nodes[cpu] : 0;
+    }
+
+#ifdef __linux__
+    inline bool setAffinity(pthread_t thread, const CpuSet_t& cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (cpus.empty())
+            for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                CPU_SET(cpu, &set);
+        for (auto cpu: cpus)
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+
+    // Pins the thread to the CPUs. Returns false if it is not supported or none of the CPUs are available.
+    inline bool pin(std::thread& thread, const CpuSet_t& cpus) {
+        return thread.joinable() && setAffinity(thread.native_handle(), cpus);
+    }
+
+    inline bool pinCurrent(const CpuSet_t& cpus) {
+        return setAffinity(pthread_self(), cpus);
+    }
+
+    // The NUMA node the calling thread runs on. A pinned thread stays on the node of its CPUs.
+    inline unsigned int currentNode() {
+        auto cpu = sched_getcpu();
+        return cpu < 0 ? 0 : nodeOfCpu(static_cast<unsigned int>(cpu));
+    }
+#else
+    inline bool pin(std::thread&, const CpuSet_t& cpus) {return cpus.empty();}
+    inline bool pinCurrent(const CpuSet_t& cpus) {return cpus.empty();}
+    inline unsigned int currentNode() {return 0;}
+#endif
+} // Cpus
+
+#endif //CPP_ACTORS_CPU_H
@@ -21,13 +21,24 @@
 #include <functional>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <utility>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <future>
+#include <algorithm>
 #include <fstream>
 #include <iterator>
+#include <limits>
 #include "Queue.h"
+#include "Memory.h"
 #include "Message.h"
+#include "Scheduler.h"
+#include "Cpu.h"
 
 using namespace Messages;
 
@@ -35,111 +46,1108 @@ using namespace Messages;
 namespace Dispatchers
 {
     typedef std::function<void(Message*)> Function_t;
+    typedef std::function<void()> Job_t;
     typedef unsigned long FuncId_t;
-    static FuncId_t nextFuncId = 0;
-    static std::map<FuncId_t, Function_t> cbFuncs[Message_t::NO_OF_MSG_TYPES];
-    static std::mutex mutex;
-    static std::atomic_ulong pendingJobs = 0;
+    static const std::size_t BatchSize = 64; // Max. number of entries a worker takes from a queue at a time.
 
+    // Each priority has its own lane. Higher lanes are always drained first.
+    enum Priority {HIGH_PRIORITY, NORMAL_PRIORITY, LOW_PRIORITY};
+    static const std::size_t NoOfPriorities = 3;
+    static const std::size_t StarvationLimit = 16; // Max. number of times a waiting lane is passed over by higher lanes.
 
-    class Worker
+    class Dispatcher;
+
+
+    // Selects the lane to take the next entry from: the highest non-empty lane, unless a lower lane
+    // has been passed over StarvationLimit times. Only used by one thread at a time.
+    class LaneSelector
+    {
+    private:
+        std::size_t noPassedOver[NoOfPriorities] = {};
+
+    public:
+        template<typename IsEmpty>
+        int select(const IsEmpty& isEmpty) {
+            int lane = -1;
+            for (std::size_t i = 0; i < NoOfPriorities; i++) {
+                if (isEmpty(i))
+                    noPassedOver[i] = 0;
+                else if (lane < 0 || (noPassedOver[i] >= StarvationLimit && noPassedOver[lane] < StarvationLimit))
+                    lane = static_cast<int>(i);
+            }
+            for (std::size_t i = 0; lane >= 0 && i < NoOfPriorities; i++)
+                if (!isEmpty(i))
+                    noPassedOver[i] = static_cast<int>(i) == lane ? 0 : noPassedOver[i] + 1;
+            return lane;
+        }
+    }; // LaneSelector
+
+
+    // A Mailbox is a serial execution context. Jobs posted to a mailbox with the same priority are executed
+    // in FIFO order, jobs with a higher priority overtake them. Jobs are never executed concurrently,
+    // but any free worker may execute them.
+    class Mailbox: public std::enable_shared_from_this<Mailbox>
     {
     private:
-        bool doLoop = true;
+        Queues::MpscQueue<Job_t> jobs[NoOfPriorities];
+        std::atomic<bool> scheduled{false};
+        std::atomic<bool> running{false};
+        std::atomic<bool> closed{false};
+        std::atomic<int> scheduledPriority{LOW_PRIORITY};
+        LaneSelector selector;
+        Dispatcher& dispatcher; // Executes the jobs.
+
+        // A mailbox that is already scheduled must be scheduled again if a job with a higher
+        // priority arrives, i.e. it may be queued more than once. Only the first entry runs it.
+        bool mustSchedule(Priority priority) {
+            if (!scheduled.exchange(true)) {
+                scheduledPriority = priority;
+                return true;
+            }
+            auto current = scheduledPriority.load();
+            while (priority < current && !running)
+                if (scheduledPriority.compare_exchange_weak(current, priority))
+                    return true;
+            return false;
+        }
+
+        Priority highestPending() const {
+            for (std::size_t i = 0; i < NoOfPriorities; i++)
+                if (!jobs[i].empty())
+                    return static_cast<Priority>(i);
+            return LOW_PRIORITY;
+        }
+
+    public:
+        explicit Mailbox(Dispatcher& dispatcher): dispatcher(dispatcher) {}
+        Mailbox(const Mailbox&) = delete;
+        Mailbox& operator=(const Mailbox&) = delete;
+        virtual ~Mailbox() { clear(); } // No worker runs the mailbox any more.
+
+        void post(Job_t job, Priority priority = NORMAL_PRIORITY);
+        void post(const std::vector<Job_t>& jobs, Priority priority = NORMAL_PRIORITY);
+
+        // Posts the job of an expired timer. Within a Schedulers::JobBatch the mailbox is handed to the workers
+        // together with the other mailboxes of the batch when it ends.
+        void postExpired(Job_t job);
+
+        // Queues the job(s) without scheduling the mailbox. Returns true if the caller must schedule it.
+        bool enqueue(Job_t job, Priority priority = NORMAL_PRIORITY) {
+            if (closed)
+                return false;
+            Schedulers::Clock::beginJobs(1);
+            jobs[priority].push(std::move(job));
+            return mustSchedule(priority);
+        }
+
+        bool enqueue(const std::vector<Job_t>& jobs, Priority priority = NORMAL_PRIORITY) {
+            if (closed)
+                return false;
+            Schedulers::Clock::beginJobs(static_cast<long>(jobs.size()));
+            this->jobs[priority].pushAll(jobs);
+            return mustSchedule(priority);
+        }
+
+        bool empty() const {
+            for (const auto& lane: jobs)
+                if (!lane.empty())
+                    return false;
+            return true;
+        }
+
+        // Executed by one worker at a time. Runs at most maxJobs before giving the worker back.
+        void run(std::size_t maxJobs);
+
+        // Drops all pending and future jobs, i.e. jobs that refer to a deleted Actor are never executed.
+        // The pending jobs are dropped by the worker that runs the mailbox next, or when the mailbox is deleted.
+        void close() {
+            closed = true;
+        }
+
+        // Drops all pending jobs. Only called by the consumer, i.e. the worker running the mailbox, or when no worker can run it.
+        void clear() {
+            Job_t job;
+            long noCleared = 0;
+            for (auto& lane: jobs)
+                while (lane.tryGet(job))
+                    noCleared++;
+            Schedulers::Clock::endJobs(noCleared);
+        }
+    }; // Mailbox
+
+    typedef std::shared_ptr<Mailbox> MailboxPtr_t;
+
+
+    struct Subscriber
+    {
+        FuncId_t funcId;
+        Function_t func;
+        MailboxPtr_t mailbox;
+    }; // Subscriber
+
+    typedef std::vector<std::shared_ptr<const Subscriber>> Callbacks_t;
+
+
+    // Applied when a message type has reached its capacity:
+    // BLOCK:       The publisher waits until there is room. Don't use it for messages published by Actors,
+    //              i.e. by Dispatcher workers, as they may end up waiting for themselves.
+    // DROP_OLDEST: The oldest undelivered message of the type is dropped.
+    // DROP_NEWEST: The published message is dropped.
+    // REJECT:      The published message is dropped and publish returns false.
+    enum OverflowPolicy {BLOCK, DROP_OLDEST, DROP_NEWEST, REJECT};
+    typedef std::function<void(Message_t type, std::size_t noInFlight)> WatermarkFunction_t;
+
+    class Limit;
+
+
+    // Shared by all deliveries of a published message. Releases its reference to the message when the last delivery is done.
+    struct Envelope
+    {
+        MessagePtr_t msg;
+        Limit* limit = nullptr; // Only set if the message is counted by the limit of its type.
+        std::atomic<bool> dropped{false};
+
+        explicit Envelope(Message* msg): msg(msg) {}
+        ~Envelope();
+    }; // Envelope
+
+    typedef MemoryManagement::PoolAllocator<Envelope, MemoryManagement::MESSAGES> EnvelopeAllocator_t;
+
+    typedef std::shared_ptr<Envelope> EnvelopePtr_t;
+
+
+    // Capacity and watermarks of a message type. Counts the messages that are published but not yet handled by all subscribers.
+    class Limit
+    {
+    private:
+        Message_t type = Message_t::NONE;
+        std::atomic<bool> enabled{false};
+        std::atomic<std::size_t> capacity{0}; // 0 means unbounded.
+        std::atomic<OverflowPolicy> policy{OverflowPolicy::BLOCK};
+        std::atomic<std::size_t> highWatermark{0}; // 0 means no watermarks.
+        std::atomic<std::size_t> lowWatermark{0};
+        WatermarkFunction_t onHighWatermark;
+        WatermarkFunction_t onLowWatermark;
+        std::atomic<std::size_t> noInFlight{0};
+        std::atomic<bool> aboveHighWatermark{false};
+        std::atomic<std::size_t> noBlocked{0};
+        std::mutex mutex;
+        std::condition_variable spaceAvailable;
+        std::deque<std::weak_ptr<Envelope>> undelivered; // Only used by DROP_OLDEST.
+
+        void added(std::size_t inFlight) {
+            auto high = highWatermark.load();
+            if (high > 0 && inFlight >= high && !aboveHighWatermark.exchange(true)) {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto func = onHighWatermark;
+                lock.unlock();
+                if (func)
+                    func(type, inFlight);
+            }
+        }
+
+        void dropOldest() { // mutex must be locked.
+            while (noInFlight >= capacity && !undelivered.empty()) {
+                auto envelope = undelivered.front().lock();
+                undelivered.pop_front();
+                if (envelope && !envelope->dropped.exchange(true))
+                    noInFlight--;
+            }
+            if (undelivered.size() > 2*capacity) // Remove delivered messages that are not in front of the queue.
+                undelivered.erase(std::remove_if(undelivered.begin(), undelivered.end(), [](const std::weak_ptr<Envelope>& env) {return env.expired();}), undelivered.end());
+        }
+
+    public:
+        Limit() = default;
+        Limit(const Limit&) = delete;
+        Limit& operator=(const Limit&) = delete;
+        virtual ~Limit() = default;
+
+        void setType(Message_t msgType) {type = msgType;}
+
+        void setCapacity(std::size_t maxInFlight, OverflowPolicy overflowPolicy) {
+            std::unique_lock<std::mutex> lock(mutex);
+            capacity = maxInFlight;
+            policy = overflowPolicy;
+            enabled = capacity > 0 || highWatermark > 0;
+            spaceAvailable.notify_all();
+        }
+
+        void setWatermarks(std::size_t high, std::size_t low, const WatermarkFunction_t& onHigh, const WatermarkFunction_t& onLow) {
+            assert(low < high || high == 0);
+            std::unique_lock<std::mutex> lock(mutex);
+            highWatermark = high;
+            lowWatermark = low;
+            onHighWatermark = onHigh;
+            onLowWatermark = onLow;
+            enabled = capacity > 0 || highWatermark > 0;
+        }
+
+        inline bool isEnabled() const {return enabled;}
+        inline OverflowPolicy getPolicy() const {return policy;}
+        inline std::size_t getNoInFlight() const {return noInFlight;}
+
+        // The next acquire() waits until space is available, unless messages in flight are handled before.
+        inline bool isBlocking() const {
+            auto maxInFlight = capacity.load();
+            return policy == OverflowPolicy::BLOCK && maxInFlight > 0 && noInFlight >= maxInFlight;
+        }
+
+        // Counts the envelope if there is room for it. Returns false if the message shall be dropped.
+        bool acquire(const EnvelopePtr_t& envelope) {
+            std::size_t inFlight = 0;
+            auto maxInFlight = capacity.load();
+            auto overflowPolicy = policy.load();
+            if (maxInFlight == 0 || overflowPolicy == OverflowPolicy::DROP_NEWEST || overflowPolicy == OverflowPolicy::REJECT) {
+                inFlight = noInFlight.load();
+                do {
+                    if (maxInFlight > 0 && inFlight >= maxInFlight)
+                        return false;
+                } while (!noInFlight.compare_exchange_weak(inFlight, inFlight + 1));
+                inFlight++;
+            }
+            else {
+                if (overflowPolicy == OverflowPolicy::BLOCK)
+                    Schedulers::JobBatch::flush(); // The mailboxes held back by the thread may be needed to make room.
+                std::unique_lock<std::mutex> lock(mutex);
+                if (overflowPolicy == OverflowPolicy::BLOCK) {
+                    noBlocked++;
+                    spaceAvailable.wait(lock, [this]() {return capacity == 0 || noInFlight < capacity;});
+                    noBlocked--;
+                }
+                else {
+                    dropOldest();
+                    undelivered.push_back(envelope);
+                }
+                inFlight = ++noInFlight;
+            }
+            envelope->limit = this;
+            added(inFlight);
+            return true;
+        }
+
+        void release() {
+            auto inFlight = --noInFlight;
+            if (aboveHighWatermark && inFlight <= lowWatermark && aboveHighWatermark.exchange(false)) {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto func = onLowWatermark;
+                lock.unlock();
+                if (func)
+                    func(type, inFlight);
+            }
+            if (noBlocked > 0) {
+                std::unique_lock<std::mutex> lock(mutex);
+                spaceAvailable.notify_all();
+            }
+        }
+    }; // Limit
+
+
+    inline Envelope::~Envelope() {
+        msg = MessagePtr_t();
+        if (limit && !dropped)
+            limit->release();
+    }
+
+
+    // A mailbox scheduled with the priority of its most urgent job.
+    struct Runnable
+    {
+        MailboxPtr_t mailbox;
+        Priority priority;
+    };
+
+
+    // In event loop mode a worker also owns the timers of the Actors assigned to it. Due timers are executed by the
+    // worker itself between mailboxes, i.e. the Actor jobs they post are queued on, and normally run by, the same worker.
+    class Worker: public Schedulers::TimerQueue
+    {
+    private:
+        static constexpr Schedulers::Clock_t::rep NoTimeout = std::numeric_limits<Schedulers::Clock_t::rep>::max();
+        std::atomic<bool> idle{false};
+        std::atomic<Schedulers::Clock_t::rep> idleInterval{Schedulers::Clock_t::duration(Schedulers::DefaultIdleInterval).count()};
+        std::atomic<Schedulers::Clock_t::rep> nextTimeout{NoTimeout}; // Time of plannedTick, read without the timer mutex.
+        std::vector<Schedulers::Function_t> dueFuncs;
+        std::size_t index;
+        std::vector<Worker*>& workers;
+        Cpus::CpuSet_t cpus;
         std::thread trd;
-        Queues::Queue<Message*> jobQueue{nullptr};
+        std::promise<void> started;
+        std::atomic<bool> isStarted{false};
+        Queues::MpscQueue<Runnable> jobQueue; // Lock-free inbox for mailboxes scheduled by other threads, and null wake-up tokens.
+        std::atomic<bool> draining{false}; // Held by the thread that consumes jobQueue, i.e. the owner or a thief.
+        std::mutex runQueueMutex;
+        std::deque<MailboxPtr_t> runQueue[NoOfPriorities]; // Owner takes from the front, thieves from the back.
+        LaneSelector selector;
+
+        static Worker*& current() {
+            static thread_local Worker* worker = nullptr;
+            return worker;
+        }
+
+        std::size_t noQueued() const {
+            std::size_t size = 0;
+            for (const auto& lane: runQueue)
+                size += lane.size();
+            return size;
+        }
+
+        void enqueue(std::vector<Runnable>& runnables) {
+            std::unique_lock<std::mutex> lock(runQueueMutex);
+            for (auto& runnable: runnables)
+                if (runnable.mailbox) // null entries are only used to wake up the worker.
+                    runQueue[runnable.priority].push_back(std::move(runnable.mailbox));
+            auto wakeUpOthers = noQueued() > 1;
+            lock.unlock();
+            runnables.clear();
+            if (wakeUpOthers)
+                wakeUpIdleWorker();
+        }
+
+        void lockInbox() {
+            while (draining.exchange(true, std::memory_order_acquire))
+                Queues::cpuRelax(); // A thief only holds it while it drains.
+        }
+
+        inline bool tryLockInbox() {return !draining.exchange(true, std::memory_order_acquire);}
+        inline void unlockInbox() {draining.store(false, std::memory_order_release);}
+
+        void drainInbox(std::vector<Runnable>& runnables) {
+            Runnable runnable;
+            while (runnables.size() < BatchSize && jobQueue.tryGet(runnable))
+                runnables.push_back(std::move(runnable));
+        }
+
+        MailboxPtr_t next() {
+            std::vector<Runnable> runnables;
+            lockInbox();
+            drainInbox(runnables);
+            unlockInbox();
+            if (!runnables.empty())
+                enqueue(runnables);
+
+            std::unique_lock<std::mutex> lock(runQueueMutex);
+            MailboxPtr_t mailbox;
+            auto lane = selector.select([this](std::size_t i) {return runQueue[i].empty();});
+            if (lane >= 0) {
+                mailbox = std::move(runQueue[lane].front());
+                runQueue[lane].pop_front();
+            }
+            return mailbox;
+        }
+
+        // Steals half of the most urgent lane of the first victim that has work.
+        MailboxPtr_t steal() {
+            std::vector<Runnable> stolen;
+            for (std::size_t i = 1; i < workers.size() && stolen.empty(); i++) {
+                auto* victim = workers[(index + i) % workers.size()];
+                std::unique_lock<std::mutex> lock(victim->runQueueMutex);
+                for (std::size_t lane = 0; lane < NoOfPriorities && stolen.empty(); lane++) {
+                    auto& queue = victim->runQueue[lane];
+                    auto noToSteal = (queue.size() + 1) / 2;
+                    for (std::size_t j = 0; j < noToSteal; j++) {
+                        stolen.push_back(Runnable{std::move(queue.back()), static_cast<Priority>(lane)});
+                        queue.pop_back();
+                    }
+                }
+            }
+            for (std::size_t i = 1; i < workers.size() && stolen.empty(); i++)
+                stealInbox(workers[(index + i) % workers.size()], stolen);
+            if (stolen.empty())
+                return nullptr;
+            auto mailbox = std::move(stolen.back().mailbox);
+            stolen.pop_back();
+            enqueue(stolen);
+            return mailbox;
+        }
+
+        // The inbox of a worker that is stuck in a slow callback. An idle victim drains it itself.
+        static void stealInbox(Worker* victim, std::vector<Runnable>& stolen) {
+            if (victim->idle || victim->jobQueue.empty() || !victim->tryLockInbox())
+                return;
+            std::vector<Runnable> runnables;
+            victim->drainInbox(runnables);
+            victim->unlockInbox();
+            auto noTokens = std::count_if(runnables.begin(), runnables.end(), [](const Runnable& runnable) {return !runnable.mailbox;});
+            if (noTokens > 0)
+                victim->jobQueue.push(Runnable{nullptr, NORMAL_PRIORITY}); // The victim may be about to wait for it.
+            for (auto& runnable: runnables)
+                if (runnable.mailbox)
+                    stolen.push_back(std::move(runnable));
+        }
+
+        void wakeUp(Schedulers::Tick_t tick) override {
+            plannedTick = tick;
+            nextTimeout = timeOf(tick).time_since_epoch().count();
+            if (current() != this && idle.exchange(false))
+                jobQueue.push(Runnable{nullptr, NORMAL_PRIORITY});
+        }
+
+        void execute(Schedulers::Job* job) override {
+            dueFuncs.push_back(job->func);
+        }
+
+        void timeChanged() override {
+            if (idle.exchange(false))
+                jobQueue.push(Runnable{nullptr, NORMAL_PRIORITY});
+        }
+
+        void runTimers() {
+            std::vector<Schedulers::Function_t> funcs;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                plannedTick = 0; // Timers armed while the wheel is advanced need no wake-up.
+                advance(Schedulers::Clock::now());
+                funcs.swap(dueFuncs);
+                plannedTick = wheel.nextTick();
+                nextTimeout = plannedTick == Schedulers::NoTick ? NoTimeout : timeOf(plannedTick).time_since_epoch().count();
+            }
+            MemoryManagement::EpochGuard guard;
+            Schedulers::JobBatch batch; // The mailboxes of the expired timers are queued in the run queue together.
+            for (const auto& func: funcs) {
+                func();
+                Schedulers::Clock::endJobs(1);
+            }
+        }
+
+        // Time until the next timer expires, at most maxWait.
+        Schedulers::Clock_t::duration timeToWait(Schedulers::Clock_t::duration maxWait) const {
+            auto timeout = nextTimeout.load();
+            if (timeout == NoTimeout)
+                return maxWait;
+            auto time = Schedulers::Clock_t::duration(timeout) - Schedulers::Clock::now().time_since_epoch();
+            if (Schedulers::Clock::isVirtual() && time > Schedulers::Clock_t::duration::zero())
+                return maxWait; // Woken up by timeChanged() when the virtual time reaches the timeout.
+            return std::max(Schedulers::Clock_t::duration::zero(), std::min(time, maxWait));
+        }
+
+        void wakeUpIdleWorker() {
+            for (auto* worker: workers)
+                if (worker != this && worker->idle.exchange(false)) {
+                    worker->getQueue().push(Runnable{nullptr, NORMAL_PRIORITY});
+                    return;
+                }
+        }
 
         void run()
         {
+            current() = this;
+            std::vector<Runnable> runnables;
+            runnables.reserve(BatchSize);
             while (doLoop) {
-                auto msg = jobQueue.get(100);
-                if (msg) { // msg is null if the queue times out.
-                    pendingJobs++;
-                    if (doLoop) {
-                        std::unique_lock<std::mutex> lock(mutex);
-                        auto cbMap = cbFuncs[msg->getMsgType()];
-                        lock.unlock();
-                        for (auto it = cbMap.begin(); it != cbMap.end(); it++)
-                            if (doLoop) 
-                                it->second(msg);
+                if (nextTimeout.load() != NoTimeout && timeToWait(std::chrono::milliseconds(1)) == Schedulers::Clock_t::duration::zero())
+                    runTimers();
+                auto mailbox = next();
+                if (!mailbox)
+                    mailbox = steal();
+                if (!mailbox) {
+                    idle = true;
+                    mailbox = next(); // Work may have been queued before the worker was marked idle.
+                    if (!mailbox)
+                        mailbox = steal();
+                    if (!mailbox) {
+                        auto interval = Schedulers::Clock_t::duration(idleInterval.load());
+                        auto wait = timeToWait(interval); // Read after the worker is marked idle, see wakeUp().
+                        if (wait == Schedulers::NoIdleWakeUp)
+                            MemoryManagement::Memory::freeMarkedMem(); // The worker may be parked for good.
+                        lockInbox(); // Held while the worker waits, i.e. thieves leave the inbox of an idle worker alone.
+                        auto noRunnables = jobQueue.getAll(runnables, BatchSize, wait); // runnables is empty if the queue times out.
+                        unlockInbox();
+                        if (noRunnables == 0 && wait == interval)
+                            MemoryManagement::Memory::freeMarkedMem();
+                        enqueue(runnables);
                     }
-                    delete msg;
-                    pendingJobs--;
-                    if (pendingJobs == 0)
-                        MemoryManagement::Memory::freeMarkedMem();
+                    idle = false;
+                }
+                if (mailbox && doLoop) {
+                    MemoryManagement::EpochGuard guard; // Actors deleted while the mailbox runs are not freed until it returns.
+                    mailbox->run(BatchSize);
                 }
             }
+            current() = nullptr;
+        }
+
+        Worker(std::size_t index, std::vector<Worker*>& workers, Cpus::CpuSet_t cpus): index(index), workers(workers), cpus(std::move(cpus)) {}
+
+    public:
+        // The worker is constructed by its own thread after the thread is pinned, i.e. the worker, its queues, its timers
+        // and its memory pool are allocated on the NUMA node of its CPUs. It runs no jobs before start() is called.
+        static Worker* create(std::size_t index, std::vector<Worker*>& workers, const Cpus::CpuSet_t& cpus) {
+            std::promise<Worker*> created;
+            auto worker = created.get_future();
+            std::thread trd([created = std::move(created), index, &workers, cpus]() mutable {
+                if (!cpus.empty())
+                    Cpus::pinCurrent(cpus);
+                auto* self = new Worker(index, workers, cpus);
+                auto started = self->started.get_future();
+                created.set_value(self);
+                started.wait();
+                self->run();});
+            auto* self = worker.get();
+            self->trd = std::move(trd);
+            return self;
+        }
+
+        virtual ~Worker() {
+            stop();
+            Runnable runnable;
+            while (jobQueue.tryGet(runnable))
+                if (runnable.mailbox)
+                    runnable.mailbox->clear();
+            for (auto& lane: runQueue) {
+                for (auto& queued: lane)
+                    queued->clear();
+                lane.clear();
+            }
+        }
+
+        // Workers steal from each other, i.e. all workers must be created before any of them are started.
+        void start() {
+            if (!isStarted.exchange(true))
+                started.set_value();
         }
 
+        bool setAffinity(const Cpus::CpuSet_t& cpus) {
+            this->cpus = cpus;
+            return Cpus::pin(trd, cpus);
+        }
+
+        // Workers steal from each other, i.e. all workers must be stopped before any of them are deleted.
         void stop() {
             doLoop = false;
+            start(); // A worker that was never started exits at once.
+            jobQueue.push(Runnable{nullptr, NORMAL_PRIORITY});
             if (trd.joinable())
                 trd.join();
-            while (jobQueue.size() > 0)
-                delete jobQueue.get();
         }
 
-    public:
-        Worker() { trd = std::thread([this]() { run(); }); }
-        virtual ~Worker() { stop(); }
+        template<typename Rep, typename Period>
+        void setWaitStrategy(Queues::WaitStrategy strategy, std::chrono::duration<Rep, Period> spinTime, Schedulers::Clock_t::duration idleInterval) {
+            jobQueue.setWaitStrategy(strategy, spinTime);
+            this->idleInterval = idleInterval.count();
+            jobQueue.push(Runnable{nullptr, NORMAL_PRIORITY}); // A parked worker applies the new idle interval at once.
+        }
+
+        // Mailboxes scheduled by a worker stay on that worker until they are stolen. Only workers of the same
+        // Dispatcher (workers) take them, i.e. the mailboxes of one runtime never run on the workers of another.
+        static bool scheduleOnCurrent(const Runnable& runnable, const std::vector<Worker*>& workers) {
+            auto* worker = current();
+            if (worker == nullptr || &worker->workers != &workers)
+                return false;
+            worker->push(runnable);
+            return true;
+        }
+
+        static bool scheduleOnCurrent(const std::vector<Runnable>& runnables, const std::vector<Worker*>& workers) {
+            auto* worker = current();
+            if (worker == nullptr || &worker->workers != &workers)
+                return false;
+            worker->pushAll(runnables);
+            return true;
+        }
 
-        inline Queues::Queue <Message*>& getQueue() { return jobQueue; }
+        // Claims an idle worker for the caller, i.e. no other scheduling thread picks it as well.
+        inline bool claimIdle() {return idle.load(std::memory_order_relaxed) && idle.exchange(false);}
+
+        // Other threads queue the mailboxes in the lock-free inbox, which wakes the worker if it waits. The owner
+        // queues them in its run queue. Thieves take them from either, i.e. also from the inbox while the owner is busy.
+        void push(const Runnable& runnable) {
+            if (current() != this)
+                jobQueue.push(runnable);
+            else
+                pushAll(std::vector<Runnable>{runnable});
+        }
+
+        void pushAll(const std::vector<Runnable>& runnables) {
+            if (current() != this) {
+                jobQueue.pushAll(runnables);
+                return;
+            }
+            std::unique_lock<std::mutex> lock(runQueueMutex);
+            for (const auto& runnable: runnables)
+                runQueue[runnable.priority].push_back(runnable.mailbox);
+            auto wakeUpOthers = noQueued() > 1;
+            lock.unlock();
+            if (wakeUpOthers)
+                wakeUpIdleWorker();
+        }
+
+        inline Queues::MpscQueue<Runnable>& getQueue() { return jobQueue; }
     }; // Worker
 
 
+    // Applied when a Dispatcher is created, for the default runtime by the first call of Dispatcher::getInstance().
+    struct DispatcherConfig
+    {
+        std::size_t noOfWorkers = 0; // 0: One worker per CPU set, or per CPU if there are no CPU sets.
+        std::vector<Cpus::CpuSet_t> cpuSets; // Worker i is pinned to cpuSets[i % cpuSets.size()]. Workers are not pinned if empty.
+    }; // DispatcherConfig
+
+
+    // Delivers the published messages to the subscribers and executes their callbacks on a pool of workers.
+    // The Dispatcher of the default runtime is returned by getInstance(), other runtimes create their own.
     class Dispatcher
     {
+    public:
+        typedef DispatcherConfig Config;
+
     private:
+        Schedulers::Scheduler& scheduler;
+        std::mutex mutex; // Serializes writers of cbFuncs. Readers never lock.
+        FuncId_t nextFuncId = 0;
+        std::atomic<const Callbacks_t*> cbFuncs[MaxNoOfMsgTypes] = {}; // Immutable snapshots - replaced and retired, never modified.
         std::vector<Worker*> workers;
         std::size_t noWorkers = 0;
+        std::atomic<std::size_t> nextWorker{0};
+        std::atomic<bool> eventLoop{false};
+        std::atomic<std::size_t> nextTimers{0};
+        Limit limits[MaxNoOfMsgTypes];
+        std::atomic<bool> parallelFanOut[MaxNoOfMsgTypes] = {};
+        std::atomic<Priority> priorities[MaxNoOfMsgTypes];
+
+        static Config& config() {
+            static Config MyConfig;
+            return MyConfig;
+        }
+
+        static std::atomic<bool>& created() {
+            static std::atomic<bool> isCreated{false};
+            return isCreated;
+        }
 
-        static unsigned int noOfCpus() {
-            unsigned int cores = std::thread::hardware_concurrency();
-            if (cores == 0)
-                cores = 4;
-            return cores;
+        static const Config& defaultConfig() {
+            created() = true;
+            return config();
         }
 
-        Dispatcher() {
-            for (unsigned int i = 0; i < noOfCpus(); i++)
-                workers.push_back(new Worker());
+        // Mailboxes of expired timers held back by the calling thread, see scheduleExpired().
+        struct HeldBack
+        {
+            Dispatcher* dispatcher = nullptr;
+            std::vector<Runnable> runnables;
+        };
+
+        // An idle worker if there is one, i.e. the mailboxes are not queued behind a busy worker. Otherwise round robin.
+        Worker* target() {
+            auto first = nextWorker++;
+            for (std::size_t i = 0; i < noWorkers; i++) {
+                auto* worker = workers[(first + i) % noWorkers];
+                if (worker->claimIdle())
+                    return worker;
+            }
+            return workers[first % noWorkers];
+        }
+
+        static HeldBack& heldBack() {
+            static thread_local HeldBack held;
+            return held;
+        }
+
+        static void scheduleHeldBack() {
+            auto& held = heldBack();
+            std::vector<Runnable> runnables;
+            runnables.swap(held.runnables);
+            auto* dispatcher = held.dispatcher;
+            held.dispatcher = nullptr;
+            if (dispatcher != nullptr)
+                dispatcher->schedule(runnables);
+        }
+
+    public:
+        // Timers of the Actors are handled by the scheduler, or by the workers in event loop mode.
+        explicit Dispatcher(Schedulers::Scheduler& scheduler, const Config& config = Config()): scheduler(scheduler) {
+            for (unsigned int type = 0; type < MaxNoOfMsgTypes; type++) {
+                limits[type].setType(static_cast<Message_t>(type));
+                priorities[type] = NORMAL_PRIORITY;
+            }
+            const auto& cpuSets = config.cpuSets;
+            auto n = config.noOfWorkers > 0 ? config.noOfWorkers : !cpuSets.empty() ? cpuSets.size() : Cpus::noOfCpus();
+            for (std::size_t i = 0; i < n; i++)
+                workers.push_back(Worker::create(i, workers, cpuSets.empty() ? Cpus::CpuSet_t() : cpuSets[i % cpuSets.size()]));
+            for (auto* worker: workers)
+                worker->start();
             noWorkers = workers.size();
         }
 
         virtual ~Dispatcher() {
             noWorkers = 0;
+            for (auto* worker: workers)
+                worker->stop();
             for (auto* worker: workers)
                 delete worker;
             workers.clear();
+            for (auto& callbacks: cbFuncs)
+                delete callbacks.exchange(nullptr);
         };
 
-    public:
+        Dispatcher(const Dispatcher&) = delete;
+        Dispatcher& operator=(const Dispatcher&) = delete;
+
         static Dispatcher& getInstance() {
-            static Dispatcher MyDispatcher;
+            static Dispatcher MyDispatcher(Schedulers::Scheduler::getInstance(), defaultConfig());
             return MyDispatcher;
         }
 
-        FuncId_t registerCB(const Function_t& func, Message_t type) {
-            assert(type != Message_t::NONE && type != Message_t::NO_OF_MSG_TYPES);
+        // The Dispatcher of the mailbox the calling thread is running, nullptr outside of Actor callbacks.
+        static Dispatcher*& running() {
+            static thread_local Dispatcher* dispatcher = nullptr;
+            return dispatcher;
+        }
+
+        // The Dispatcher of the Actor whose callback the calling thread executes, otherwise the default Dispatcher.
+        static Dispatcher& getCurrent() {
+            auto* dispatcher = running();
+            return dispatcher != nullptr ? *dispatcher : getInstance();
+        }
+
+        // Must be called before the default Dispatcher is created, i.e. before any Actors. Returns false if it is too late.
+        static bool configure(const Config& config) {
+            if (created())
+                return false;
+            Dispatcher::config() = config;
+            return true;
+        }
+
+        std::size_t getNoOfWorkers() const {
+            return noWorkers;
+        }
+
+        // Pins a worker to other CPUs at runtime. Memory already allocated by the worker is not moved.
+        bool setAffinity(std::size_t worker, const Cpus::CpuSet_t& cpus) {
+            return worker < noWorkers && workers[worker]->setAffinity(cpus);
+        }
+
+        // All callbacks registered with the same mailbox are executed in publishing order and never concurrently.
+        // Callbacks registered without a mailbox get a mailbox of their own.
+        FuncId_t registerCB(const Function_t& func, Message_t type, const MailboxPtr_t& mailbox = nullptr) {
+            assert(isValidMsgType(type));
             std::unique_lock<std::mutex> lock(mutex);
             auto funcId = nextFuncId++;
-            cbFuncs[type][funcId] = func;
+            auto subscriber = std::make_shared<const Subscriber>(Subscriber{funcId, func, mailbox ? mailbox : std::make_shared<Mailbox>(*this)});
+            auto* current = cbFuncs[type].load();
+            auto* callbacks = current ? new Callbacks_t(*current) : new Callbacks_t();
+            callbacks->push_back(subscriber); // funcIds are increasing, i.e. the snapshot stays sorted.
+            cbFuncs[type].store(callbacks, std::memory_order_release);
+            MemoryManagement::Memory::retire(current); // Deleted when no publisher can read it anymore.
             return funcId;
         }
 
         void unregisterCB(const FuncId_t& funcId, Message_t type) {
             std::unique_lock<std::mutex> lock(mutex);
-            cbFuncs[type].erase(funcId);
+            auto* current = cbFuncs[type].load();
+            if (current) {
+                auto* callbacks = new Callbacks_t();
+                callbacks->reserve(current->size());
+                for (const auto& subscriber: *current)
+                    if (subscriber->funcId != funcId)
+                        callbacks->push_back(subscriber);
+                if (callbacks->empty()) {
+                    delete callbacks;
+                    callbacks = nullptr;
+                }
+                cbFuncs[type].store(callbacks, std::memory_order_release);
+                MemoryManagement::Memory::retire(current);
+            }
+        }
+
+        void schedule(const MailboxPtr_t& mailbox, Priority priority) {
+            Runnable runnable{mailbox, priority};
+            if (noWorkers > 0 && !Worker::scheduleOnCurrent(runnable, workers))
+                target()->push(runnable);
+        }
+
+        // All mailboxes are handed to one worker in one operation. The workers balance the load by stealing.
+        void schedule(const std::vector<Runnable>& runnables) {
+            if (noWorkers > 0 && !runnables.empty() && !Worker::scheduleOnCurrent(runnables, workers))
+                target()->pushAll(runnables);
         }
 
-        void publish(Message* msg) {
-            if (noWorkers > 0) {
-                auto msgType = msg->getMsgType();
-                auto worker = workers[msgType % noWorkers];
-                worker->getQueue().push(msg);
+        // The mailboxes are held back while the calling thread executes a Schedulers::JobBatch, and scheduled
+        // in one operation when it ends.
+        void scheduleExpired(const MailboxPtr_t& mailbox, Priority priority) {
+            if (!Schedulers::JobBatch::isActive()) {
+                schedule(mailbox, priority);
+                return;
             }
+            auto& held = heldBack();
+            if (held.dispatcher != this) {
+                if (held.dispatcher == nullptr)
+                    Schedulers::JobBatch::defer(&Dispatcher::scheduleHeldBack);
+                else
+                    scheduleHeldBack(); // The timers of another runtime.
+                held.dispatcher = this;
+            }
+            held.runnables.push_back(Runnable{mailbox, priority});
+        }
+
+        // Capacity is the max. number of published messages of the type that are not yet handled by all subscribers.
+        void setCapacity(Message_t type, std::size_t capacity, OverflowPolicy policy = OverflowPolicy::BLOCK) {
+            assert(isValidMsgType(type));
+            limits[type].setCapacity(capacity, policy);
+        }
+
+        // onHigh is called when the number of messages in flight reaches high, and onLow when it afterwards falls to low.
+        void setWatermarks(Message_t type, std::size_t high, std::size_t low, const WatermarkFunction_t& onHigh, const WatermarkFunction_t& onLow) {
+            assert(isValidMsgType(type));
+            limits[type].setWatermarks(high, low, onHigh, onLow);
+        }
+
+        std::size_t getNoInFlight(Message_t type) const {
+            return limits[type].getNoInFlight();
+        }
+
+        // Hands each mailbox to a different worker, i.e. the mailboxes are executed in parallel right away
+        // instead of waiting to be stolen. The first mailbox stays on the current worker.
+        void spread(const std::vector<Runnable>& runnables) {
+            if (noWorkers == 0 || runnables.empty())
+                return;
+            std::size_t first = Worker::scheduleOnCurrent(runnables.front(), workers) ? 1 : 0;
+            auto next = nextWorker.fetch_add(runnables.size());
+            for (auto i = first; i < runnables.size(); i++)
+                workers[(next + i) % noWorkers]->push(runnables[i]);
+        }
+
+        // With parallel fan-out the subscribers (Actors) of a message are started on different workers at the same time,
+        // i.e. the latency of a message is that of the slowest subscriber rather than the sum of all subscribers.
+        // Without it the subscribers are queued on the publishing worker and the other workers steal them when idle.
+        void setParallelFanOut(Message_t type, bool enabled) {
+            assert(isValidMsgType(type));
+            parallelFanOut[type] = enabled;
+        }
+
+        // In event loop mode each Dispatcher worker owns the timers (scheduled jobs, Timers and State Machine timeouts)
+        // of the Actors created afterwards, i.e. timeouts are handled without passing the Scheduler threads.
+        // Actors created before keep using the Scheduler.
+        void setEventLoop(bool enabled) {
+            eventLoop = enabled;
+        }
+
+        bool getEventLoop() const {
+            return eventLoop;
+        }
+
+        // How idle workers wait for messages, see Queues::WaitStrategy. The spinning strategies trade CPU time for
+        // wake-ups in microseconds, also of the timers in event loop mode. An idle worker also wakes up every
+        // idleInterval to free memory. With NoIdleWakeUp it frees the memory before it parks and then only wakes up for work.
+        template<typename Rep, typename Period>
+        void setWaitStrategy(Queues::WaitStrategy strategy, std::chrono::duration<Rep, Period> spinTime = Queues::DefaultSpinTime, Schedulers::Clock_t::duration idleInterval = Schedulers::DefaultIdleInterval) {
+            for (auto* worker: workers)
+                worker->setWaitStrategy(strategy, spinTime, idleInterval);
+        }
+
+        void setWaitStrategy(Queues::WaitStrategy strategy) {
+            setWaitStrategy(strategy, Queues::DefaultSpinTime);
+        }
+
+        // The timers of a new Actor. The workers are assigned round robin.
+        Schedulers::TimerQueue& getTimers() {
+            if (eventLoop && noWorkers > 0)
+                return *workers[nextTimers++ % noWorkers];
+            return scheduler;
+        }
+
+        inline Schedulers::Scheduler& getScheduler() {return scheduler;}
+
+        // Messages of the type are published with the given priority unless another priority is given when published.
+        void setPriority(Message_t type, Priority priority) {
+            assert(isValidMsgType(type));
+            priorities[type] = priority;
+        }
+
+        Priority getPriority(Message_t type) const {
+            return priorities[type];
+        }
+
+        // Returns false if the message is rejected due to the REJECT overflow policy.
+        bool publish(Message* msg) {
+            return publish(msg, priorities[msg->getMsgType()]);
+        }
+
+        // The snapshot of the subscribers is read within an epoch, i.e. without a lock or a shared reference count.
+        bool publish(Message* msg, Priority priority) {
+            auto& snapshot = cbFuncs[msg->getMsgType()];
+            if (noWorkers == 0 || snapshot.load(std::memory_order_relaxed) == nullptr) {
+                MessagePtr_t unused(msg); // Deleted unless it is retained by someone else.
+                return true;
+            }
+            auto& limit = limits[msg->getMsgType()];
+            auto envelope = std::allocate_shared<Envelope>(EnvelopeAllocator_t(), msg); // Deletes the message when the last subscriber is done with it.
+            if (limit.isEnabled() && !limit.acquire(envelope))
+                return limit.getPolicy() != OverflowPolicy::REJECT;
+            MemoryManagement::EpochGuard guard; // Entered after the publisher may have waited for capacity.
+            auto* callbacks = snapshot.load(std::memory_order_acquire);
+            if (callbacks == nullptr)
+                return true; // The last subscriber is gone.
+            auto job = [envelope](const std::shared_ptr<const Subscriber>& subscriber) {
+                return [subscriber, envelope]() {
+                    if (!envelope->dropped)
+                        subscriber->func(envelope->msg.get());};
+            };
+            if (parallelFanOut[msg->getMsgType()] && callbacks->size() > 1) {
+                std::vector<Runnable> runnables;
+                for (const auto& subscriber: *callbacks)
+                    if (subscriber->mailbox->enqueue(job(subscriber), priority))
+                        runnables.push_back(Runnable{subscriber->mailbox, priority});
+                spread(runnables);
+            }
+            else
+                for (const auto& subscriber: *callbacks)
+                    subscriber->mailbox->post(job(subscriber), priority);
+            return true;
+        }
+
+        // Publishes a range of messages. The jobs are grouped per mailbox and priority and each group is queued with one
+        // atomic operation. The mailboxes that must be scheduled are handed to the workers with one wake-up.
+        // Returns the number of messages that are not rejected due to the REJECT overflow policy.
+        // Messages of the batch that are not queued yet are queued before the publisher waits for capacity,
+        // i.e. a batch larger than the capacity of a BLOCK limit never waits for itself.
+        template<typename Iterator>
+        std::size_t publish(Iterator first, Iterator last) {
+            std::size_t noAccepted = 0;
+            std::vector<std::pair<Runnable, std::vector<Job_t>>> groups;
+            std::unordered_map<Mailbox*, std::size_t> groupIndex[NoOfPriorities];
+            auto enqueueGroups = [this, &groups, &groupIndex]() {
+                std::vector<Runnable> runnables;
+                for (const auto& group: groups)
+                    if (group.first.mailbox->enqueue(group.second, group.first.priority))
+                        runnables.push_back(group.first);
+                schedule(runnables);
+                groups.clear();
+                for (auto& index: groupIndex)
+                    index.clear();
+            };
+            for (auto it = first; it != last; ++it) {
+                Message* msg = *it;
+                auto& snapshot = cbFuncs[msg->getMsgType()];
+                if (noWorkers == 0 || snapshot.load(std::memory_order_relaxed) == nullptr) {
+                    MessagePtr_t unused(msg); // Deleted unless it is retained by someone else.
+                    noAccepted++;
+                    continue;
+                }
+                auto& limit = limits[msg->getMsgType()];
+                auto envelope = std::allocate_shared<Envelope>(EnvelopeAllocator_t(), msg); // Deletes the message when the last subscriber is done with it.
+                if (limit.isEnabled() && !groups.empty() && limit.isBlocking())
+                    enqueueGroups();
+                if (limit.isEnabled() && !limit.acquire(envelope)) {
+                    if (limit.getPolicy() != OverflowPolicy::REJECT)
+                        noAccepted++;
+                    continue;
+                }
+                noAccepted++;
+                auto priority = priorities[msg->getMsgType()].load();
+                MemoryManagement::EpochGuard guard;
+                auto* callbacks = snapshot.load(std::memory_order_acquire);
+                if (callbacks == nullptr)
+                    continue;
+                for (const auto& subscriber: *callbacks) {
+                    auto group = groupIndex[priority].find(subscriber->mailbox.get());
+                    if (group == groupIndex[priority].end()) {
+                        group = groupIndex[priority].emplace(subscriber->mailbox.get(), groups.size()).first;
+                        groups.emplace_back(Runnable{subscriber->mailbox, priority}, std::vector<Job_t>());
+                    }
+                    groups[group->second].second.emplace_back([subscriber, envelope]() {
+                        if (!envelope->dropped)
+                            subscriber->func(envelope->msg.get());});
+                }
+            }
+            enqueueGroups();
+            return noAccepted;
         }
     }; // Dispatcher
+
+
+    inline void Mailbox::post(Job_t job, Priority priority) {
+        if (enqueue(std::move(job), priority))
+            dispatcher.schedule(shared_from_this(), priority);
+    }
+
+    inline void Mailbox::post(const std::vector<Job_t>& jobs, Priority priority) {
+        if (enqueue(jobs, priority))
+            dispatcher.schedule(shared_from_this(), priority);
+    }
+
+    inline void Mailbox::postExpired(Job_t job) {
+        if (enqueue(std::move(job)))
+            dispatcher.scheduleExpired(shared_from_this(), NORMAL_PRIORITY);
+    }
+
+    inline void Mailbox::run(std::size_t maxJobs) {
+        if (running.exchange(true))
+            return; // Already executed by another worker, i.e. the mailbox was rescheduled with a higher priority.
+        auto* previous = Dispatcher::running();
+        Dispatcher::running() = &dispatcher;
+        Job_t job;
+        for (std::size_t i = 0; i < maxJobs && !closed; i++) {
+            auto lane = selector.select([this](std::size_t i) {return jobs[i].empty();});
+            if (lane < 0 || !jobs[lane].tryGet(job))
+                break;
+            job();
+            Schedulers::Clock::endJobs(1);
+        }
+        Dispatcher::running() = previous;
+        if (closed)
+            clear();
+        running = false; // Cleared first, i.e. a worker that skips the mailbox because it is running can rely on the check below.
+        scheduled = false;
+        if (!empty() && !scheduled.exchange(true)) { // Jobs posted while running, or before it was closed.
+            auto priority = highestPending();
+            scheduledPriority = priority;
+            dispatcher.schedule(shared_from_this(), priority);
+        }
+    }
+
+
+    // LOCKED:  Callbacks of an Actor are executed one at a time by its mailbox while holding the actor mutex,
+    //          i.e. other threads may safely lock the Actor.
+    // MAILBOX: Callbacks of an Actor are executed one at a time by its mailbox. Nothing is locked and
+    //          a busy Actor never blocks a worker.
+    enum ExecutionMode {LOCKED, MAILBOX};
+
+
+    // Ensures that only one callback of an Actor (messages, scheduled jobs, timers and state machines) is executed at a time.
+    class ActorContext
+    {
+    private:
+        ExecutionMode mode;
+        std::mutex mutex;
+        Dispatcher& dispatcher;
+        MailboxPtr_t mailbox;
+        Schedulers::TimerQueue& timers;
+
+    public:
+        ActorContext(Dispatcher& dispatcher, ExecutionMode mode): mode(mode), dispatcher(dispatcher), mailbox(std::make_shared<Mailbox>(dispatcher)), timers(dispatcher.getTimers()) {}
+        explicit ActorContext(ExecutionMode mode): ActorContext(Dispatcher::getInstance(), mode) {}
+        ActorContext(const ActorContext&) = delete;
+        ActorContext& operator=(const ActorContext&) = delete;
+        virtual ~ActorContext() {mailbox->close();}
+
+        inline ExecutionMode getMode() const {return mode;}
+        inline Dispatcher& getDispatcher() const {return dispatcher;}
+        inline const MailboxPtr_t& getMailbox() const {return mailbox;}
+        inline Schedulers::TimerQueue& getTimers() const {return timers;}
+
+        // Used by callbacks that already are executed by the mailbox, i.e. message callbacks.
+        // The returned lock only owns the actor mutex in LOCKED mode.
+        std::unique_lock<std::mutex> lock() {
+            return mode == ExecutionMode::LOCKED ? std::unique_lock<std::mutex>(mutex) : std::unique_lock<std::mutex>();
+        }
+
+        // Used by callbacks triggered by other threads, i.e. scheduled jobs and timers. The callbacks are executed by the
+        // Dispatcher workers, i.e. a slow callback never delays the scheduler or the timers of other Actors.
+        void post(const Job_t& job) {
+            mailbox->postExpired(wrap(job));
+        }
+
+        // The job as post() queues it. Callers that may outlive the Actor post it to a copy of the mailbox pointer,
+        // since the mailbox drops it when the Actor is deleted.
+        Job_t wrap(const Job_t& job) {
+            if (mode == ExecutionMode::LOCKED)
+                return [this, job]() {
+                    std::unique_lock<std::mutex> actorLock(mutex);
+                    job();};
+            return job;
+        }
+    }; // ActorContext
 } // Dispatchers
 
 #endif //CPP_ACTORS_DISPATCHER_H
@@ -18,52 +18,685 @@
 #ifndef CPP_ACTORS_MEMORY_H
 #define CPP_ACTORS_MEMORY_H
 #include <cstdlib>
+#include <climits>
 #include <chrono>
 #include <memory>
-#include <list>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "Cpu.h"
 
 
 namespace MemoryManagement
 {
+    static const std::size_t ChunkSize = 64 * 1024; // Chunks are aligned to their size, i.e. a block finds its chunk by masking.
+    static const std::size_t ChunkHeaderSize = 64;
+    // Above 1024 bytes the sizes are chosen so that a whole number of blocks fills a chunk, e.g. 4 blocks of 16368 bytes.
+    // Actors, Timers and State Machines of up to 16 KiB therefore share chunks instead of reserving a chunk each.
+    static constexpr std::size_t SizeClasses[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+                                                  1280, 1536, 2048, 2560, 3072, 4096, 5120, 6528, 8176, 10912, 16368};
+    static const std::size_t NoOfSizeClasses = sizeof(SizeClasses) / sizeof(SizeClasses[0]);
+    static const std::size_t MaxPooledSize = SizeClasses[NoOfSizeClasses - 1];
+    static const std::size_t LargeBlock = NoOfSizeClasses; // Size class of blocks larger than MaxPooledSize. They get a chunk of their own.
+    static const std::size_t SlabSize = 16 * ChunkSize; // Mapped at a time per NUMA node and carved into chunks.
+    static const unsigned int MaxNoOfNodes = 64;
+
+    // Memory is accounted per subsystem. Plain Memory objects are accounted as OTHER.
+    enum Subsystem {MESSAGES, QUEUES, ACTORS, TIMERS, STATE_MACHINES, OTHER, NO_OF_SUBSYSTEMS};
+
+
+    // One instance of T per thread. Instances are never freed but reused when their thread terminates,
+    // i.e. counters keep their values. Readers visit the instances of all threads with forEach.
+    template<typename T>
+    class PerThread
+    {
+    private:
+        struct Node
+        {
+            T value;
+            std::atomic<bool> inUse{true};
+            Node* next = nullptr;
+        };
+
+        struct NodeOwner
+        {
+            Node* node;
+            explicit NodeOwner(Node* node): node(node) {}
+            ~NodeOwner() {node->inUse = false;} // The node stays usable by the thread until it is gone.
+        };
+
+        static std::atomic<Node*>& nodes() {
+            static std::atomic<Node*> first{nullptr}; // Only grows.
+            return first;
+        }
+
+        static Node* acquireNode() {
+            for (auto* node = nodes().load(); node != nullptr; node = node->next) {
+                bool inUse = false;
+                if (!node->inUse.load() && node->inUse.compare_exchange_strong(inUse, true))
+                    return node;
+            }
+            auto* node = new Node();
+            node->next = nodes().load();
+            while (!nodes().compare_exchange_weak(node->next, node));
+            return node;
+        }
+
+    public:
+        static T& local() {
+            static thread_local Node* node = nullptr;
+            if (node == nullptr) {
+                node = acquireNode();
+                static thread_local NodeOwner owner(node);
+            }
+            return node->value;
+        }
+
+        template<typename Function>
+        static void forEach(const Function& func) {
+            for (auto* node = nodes().load(); node != nullptr; node = node->next)
+                func(static_cast<const T&>(node->value));
+        }
+    }; // PerThread
+
+
+    // Written by its own thread only, i.e. updating it costs a plain load and store.
+    class Counter
+    {
+    private:
+        std::atomic<long> value{0};
+
+    public:
+        inline void add(long n) {value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);}
+        inline long get() const {return value.load(std::memory_order_relaxed);}
+    }; // Counter
+
+
+    struct MemoryCounters
+    {
+        Counter allocated[NO_OF_SUBSYSTEMS]; // Bytes
+        Counter freed[NO_OF_SUBSYSTEMS];
+        Counter retired; // Bytes deleted but waiting for epoch based reclamation.
+        Counter reclaimed;
+    };
+
+
+    struct MemoryUsage
+    {
+        long liveBytes[NO_OF_SUBSYSTEMS] = {}; // Allocated and not yet deleted. MESSAGES only counts pooled messages and envelopes.
+        long totalLiveBytes = 0;
+        long deferredBytes = 0; // Deleted but not yet freed, i.e. waiting for epoch based reclamation.
+        long peakBytes = 0; // Highest sum of live and deferred bytes observed.
+        long reservedBytes = 0; // Held by the Pool, including free blocks.
+        std::chrono::microseconds maxReclamationLag{0}; // Time from delete to free.
+        std::chrono::microseconds avgReclamationLag{0};
+    };
+
+
+    struct ThreadCache;
+
+    struct Block
+    {
+        Block* next;
+    };
+
+    // Placed at the start of each chunk. All blocks of a chunk have the same size class and are
+    // returned to the cache of the thread that carved them.
+    struct Chunk
+    {
+        ThreadCache* owner;
+        std::size_t sizeClass;
+        std::size_t size;
+    };
+
+    // Per thread free lists. Blocks freed by other threads are pushed to the lock free remote lists and
+    // taken back in one operation when the local list runs empty. Caches are reused when their thread terminates.
+    struct ThreadCache
+    {
+        Block* freeList[NoOfSizeClasses] = {};
+        std::atomic<Block*> remoteFreeList[NoOfSizeClasses] = {};
+        char* unused[NoOfSizeClasses] = {}; // Part of the newest chunk that has not been carved into blocks yet.
+        char* unusedEnd[NoOfSizeClasses] = {};
+        std::atomic<bool> inUse{true};
+        unsigned int node = 0; // The NUMA node its chunks are taken from.
+        ThreadCache* next = nullptr;
+    };
+
+
+    // One source of chunks per NUMA node. The chunks are carved from slabs that are bound to the node, i.e. the
+    // blocks of a thread stay on its node also when another thread touches them first. Chunks are never returned.
+    class NodeChunks
+    {
+    private:
+        struct Source
+        {
+            std::mutex mutex;
+            char* next = nullptr;
+            char* end = nullptr;
+        };
+
+        static Source& sourceOf(unsigned int node) {
+            static Source sources[MaxNoOfNodes];
+            return sources[node % MaxNoOfNodes];
+        }
+
+        static char* mapSlab(unsigned int node) {
+#ifdef __linux__
+            auto size = SlabSize + ChunkSize; // Trimmed to a chunk aligned slab below.
+            auto* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED)
+                return nullptr;
+            auto first = reinterpret_cast<std::uintptr_t>(mem);
+            auto slab = (first + ChunkSize - 1) & ~(ChunkSize - 1);
+            if (slab > first)
+                munmap(mem, slab - first);
+            if (first + size > slab + SlabSize)
+                munmap(reinterpret_cast<void*>(slab + SlabSize), first + size - (slab + SlabSize));
+#ifdef SYS_mbind
+            static const bool isNuma = Cpus::noOfNodes() > 1;
+            if (isNuma) {
+                unsigned long nodeMask[MaxNoOfNodes / (8 * sizeof(unsigned long))] = {};
+                nodeMask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+                const int preferred = 1; // MPOL_PREFERRED, i.e. other nodes are used when the node is full.
+                syscall(SYS_mbind, slab, SlabSize, preferred, nodeMask, MaxNoOfNodes + 1, 0); // Best effort.
+            }
+#endif
+            return reinterpret_cast<char*>(slab);
+#else
+            return static_cast<char*>(std::aligned_alloc(ChunkSize, SlabSize));
+#endif
+        }
+
+    public:
+        static void* take(unsigned int node) {
+            node %= MaxNoOfNodes;
+            auto& source = sourceOf(node);
+            std::unique_lock<std::mutex> lock(source.mutex);
+            if (source.next == source.end) {
+                source.next = mapSlab(node);
+                source.end = source.next ? source.next + SlabSize : nullptr;
+                if (source.next == nullptr)
+                    return nullptr;
+            }
+            auto* chunk = source.next;
+            source.next += ChunkSize;
+            return chunk;
+        }
+    }; // NodeChunks
+
+
+    // Size class slab allocator. Allocating and freeing a block on the same thread takes no lock and no atomic operation.
+    // Chunks are kept for reuse, i.e. the pool grows to the peak usage of each size class.
+    class Pool
+    {
+    private:
+        static std::atomic<ThreadCache*>& caches() {
+            static std::atomic<ThreadCache*> first{nullptr}; // Only grows.
+            return first;
+        }
+
+        struct CacheOwner
+        {
+            ThreadCache*& cache;
+            explicit CacheOwner(ThreadCache*& cache): cache(cache) {}
+            ~CacheOwner() {
+                cache->inUse = false;
+                cache = nullptr;
+            }
+        };
+
+        // nullptr once the thread is terminating.
+        static ThreadCache*& localCache() {
+            static thread_local ThreadCache* cache = nullptr;
+            return cache;
+        }
+
+        // A thread takes a cache of the NUMA node it runs on, i.e. a pinned thread gets the memory of its node.
+        static ThreadCache* acquireCache() {
+            auto*& cache = localCache();
+            auto node = Cpus::currentNode() % MaxNoOfNodes;
+            for (auto* candidate = caches().load(); cache == nullptr && candidate != nullptr; candidate = candidate->next) {
+                bool inUse = false;
+                if (candidate->node == node && !candidate->inUse.load() && candidate->inUse.compare_exchange_strong(inUse, true))
+                    cache = candidate;
+            }
+            if (cache == nullptr) {
+                cache = new ThreadCache();
+                cache->node = node;
+                cache->next = caches().load();
+                while (!caches().compare_exchange_weak(cache->next, cache));
+            }
+            static thread_local CacheOwner owner(cache);
+            return cache;
+        }
+
+        struct SizeClassTable
+        {
+            unsigned char sizeClass[MaxPooledSize / 16 + 1] = {};
+            constexpr SizeClassTable() {
+                std::size_t current = 0;
+                for (std::size_t i = 0; i <= MaxPooledSize / 16; i++) {
+                    while (SizeClasses[current] < i * 16)
+                        current++;
+                    sizeClass[i] = static_cast<unsigned char>(current);
+                }
+            }
+        };
+
+        static std::size_t sizeClassOf(std::size_t sz) {
+            static constexpr SizeClassTable table;
+            return sz <= MaxPooledSize ? table.sizeClass[(sz + 15) / 16] : LargeBlock;
+        }
+
+        static Chunk* chunkOf(void* ptr) {
+            return reinterpret_cast<Chunk*>(reinterpret_cast<std::uintptr_t>(ptr) & ~(ChunkSize - 1));
+        }
+
+        static std::atomic<long>& reserved() {
+            static std::atomic<long> noBytes{0};
+            return noBytes;
+        }
+
+        // Chunks of a cache come from the source of its node. Large blocks have no owner and are freed with std::free.
+        static Chunk* newChunk(ThreadCache* owner, std::size_t sizeClass, std::size_t sz) {
+            auto* chunk = static_cast<Chunk*>(owner != nullptr ? NodeChunks::take(owner->node) : std::aligned_alloc(ChunkSize, sz));
+            if (chunk) {
+                chunk->owner = owner;
+                chunk->sizeClass = sizeClass;
+                chunk->size = sz;
+                reserved() += static_cast<long>(sz);
+            }
+            return chunk;
+        }
+
+        static void* allocLarge(std::size_t sz) {
+            auto* chunk = newChunk(nullptr, LargeBlock, (ChunkHeaderSize + sz + ChunkSize - 1) / ChunkSize * ChunkSize);
+            return chunk ? reinterpret_cast<char*>(chunk) + ChunkHeaderSize : nullptr;
+        }
+
+    public:
+        // The usable size of a block returned by alloc.
+        static std::size_t blockSize(void* ptr) {
+            auto* chunk = chunkOf(ptr);
+            return chunk->sizeClass == LargeBlock ? chunk->size - ChunkHeaderSize : SizeClasses[chunk->sizeClass];
+        }
+
+        static long getReservedBytes() {return reserved();}
+
+        static void* alloc(std::size_t sz) noexcept {
+            auto sizeClass = sizeClassOf(sz);
+            if (sizeClass == LargeBlock)
+                return allocLarge(sz);
+            auto* cache = localCache() ? localCache() : acquireCache();
+            auto* block = cache->freeList[sizeClass];
+            if (block == nullptr && cache->remoteFreeList[sizeClass].load(std::memory_order_relaxed) != nullptr)
+                block = cache->remoteFreeList[sizeClass].exchange(nullptr, std::memory_order_acquire);
+            if (block) {
+                cache->freeList[sizeClass] = block->next;
+                return block;
+            }
+            if (cache->unused[sizeClass] == cache->unusedEnd[sizeClass]) {
+                auto* chunk = newChunk(cache, sizeClass, ChunkSize);
+                if (chunk == nullptr)
+                    return nullptr;
+                cache->unused[sizeClass] = reinterpret_cast<char*>(chunk) + ChunkHeaderSize;
+                cache->unusedEnd[sizeClass] = cache->unused[sizeClass] + (ChunkSize - ChunkHeaderSize) / SizeClasses[sizeClass] * SizeClasses[sizeClass];
+            }
+            void* ptr = cache->unused[sizeClass];
+            cache->unused[sizeClass] += SizeClasses[sizeClass];
+            return ptr;
+        }
+
+        static void free(void* ptr) noexcept {
+            if (ptr == nullptr)
+                return;
+            auto* chunk = chunkOf(ptr);
+            if (chunk->sizeClass == LargeBlock) {
+                reserved() -= static_cast<long>(chunk->size);
+                std::free(chunk);
+                return;
+            }
+            auto* block = static_cast<Block*>(ptr);
+            if (chunk->owner == localCache()) {
+                block->next = chunk->owner->freeList[chunk->sizeClass];
+                chunk->owner->freeList[chunk->sizeClass] = block;
+            }
+            else {
+                auto& remoteFreeList = chunk->owner->remoteFreeList[chunk->sizeClass];
+                block->next = remoteFreeList.load(std::memory_order_relaxed);
+                while (!remoteFreeList.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed));
+            }
+        }
+    }; // Pool
+
+
+    // Classes derived from Pooled are allocated from the Pool and freed immediately when deleted.
+    template<Subsystem S>
+    struct Pooled
+    {
+        void* operator new(std::size_t sz) {
+            auto* ptr = Pool::alloc(sz);
+            if (ptr == nullptr)
+                throw std::bad_alloc();
+            PerThread<MemoryCounters>::local().allocated[S].add(static_cast<long>(Pool::blockSize(ptr)));
+            return ptr;
+        }
+        void* operator new[](std::size_t sz) {return Pooled::operator new(sz);}
+        void operator delete(void* ptr) noexcept {
+            if (ptr)
+                PerThread<MemoryCounters>::local().freed[S].add(static_cast<long>(Pool::blockSize(ptr)));
+            Pool::free(ptr);
+        }
+        void operator delete[](void* ptr) noexcept {Pooled::operator delete(ptr);}
+    }; // Pooled
+
+
+    // Standard allocator on top of the Pool, e.g. for std::allocate_shared.
+    template<typename T, Subsystem S>
+    struct PoolAllocator
+    {
+        typedef T value_type;
+        template<typename U> struct rebind {typedef PoolAllocator<U, S> other;};
+
+        PoolAllocator() = default;
+        template<typename U> PoolAllocator(const PoolAllocator<U, S>&) {}
+
+        T* allocate(std::size_t n) {return static_cast<T*>(Pooled<S>::operator new(n * sizeof(T)));}
+        void deallocate(T* ptr, std::size_t) noexcept {Pooled<S>::operator delete(ptr);}
+
+        template<typename U> bool operator==(const PoolAllocator<U, S>&) const {return true;}
+        template<typename U> bool operator!=(const PoolAllocator<U, S>&) const {return false;}
+    }; // PoolAllocator
+
+
+    static const unsigned long Quiescent = ULONG_MAX; // Epoch of a thread that holds no references.
+    static const unsigned long CollectInterval = 64; // Number of critical sections a thread leaves between collections.
+
+    // Memory retired by a thread. It is freed when all threads have left the epoch it was retired in.
+    struct RetiredBag
+    {
+        unsigned long epoch;
+        std::vector<void*> ptrs;
+        RetiredBag* next;
+        std::chrono::steady_clock::time_point retired; // When the first pointer was added.
+        std::vector<std::function<void()>> deleters; // Objects of which also the destructor is deferred.
+    };
+
+    // Per thread state. Records are never freed while the handler exists, but are reused when their thread terminates.
+    struct ThreadRecord
+    {
+        std::atomic<unsigned long> epoch{Quiescent};
+        std::atomic<bool> inUse{true};
+        ThreadRecord* next = nullptr;
+        std::size_t nesting = 0;
+        unsigned long noExits = 0;
+        RetiredBag* bag = nullptr;
+    };
+
+
+    // Epoch based reclamation. Threads that execute callbacks enter a critical section while doing so.
+    // Memory deleted by any thread is retired to a thread local bag tagged with the global epoch.
+    // The global epoch advances when all threads in a critical section have seen it, i.e. memory retired in
+    // epoch e is unreachable once the global epoch reaches e + 2. Neither retiring nor entering and leaving
+    // a critical section takes a lock.
     class MemoryHandler
     {
     private:
-        std::list<void*> markedForDeletion;
-        std::mutex mutex;
+        std::atomic<unsigned long> globalEpoch{0};
+        std::atomic<ThreadRecord*> records{nullptr}; // Only grows.
+        std::atomic<RetiredBag*> sealedBags{nullptr}; // Bags waiting for the global epoch to advance.
+        std::atomic<long> peakBytes{0};
+        std::atomic<long> maxLag{0}; // Microseconds
+        std::atomic<long> totalLag{0};
+        std::atomic<long> noBagsFreed{0};
+
+        struct LocalRecord
+        {
+            MemoryHandler* handler = nullptr;
+            ThreadRecord* record = nullptr;
+            ~LocalRecord() {
+                if (record)
+                    handler->releaseRecord(record);
+            }
+        };
+
+        ThreadRecord* localRecord() {
+            static thread_local LocalRecord local;
+            if (local.record == nullptr) {
+                local.handler = this;
+                local.record = acquireRecord();
+            }
+            return local.record;
+        }
+
+        ThreadRecord* acquireRecord() {
+            for (auto* record = records.load(); record != nullptr; record = record->next) {
+                bool inUse = false;
+                if (!record->inUse.load() && record->inUse.compare_exchange_strong(inUse, true))
+                    return record;
+            }
+            auto* record = new ThreadRecord();
+            record->next = records.load();
+            while (!records.compare_exchange_weak(record->next, record));
+            return record;
+        }
+
+        void releaseRecord(ThreadRecord* record) {
+            seal(record);
+            record->nesting = 0;
+            record->epoch = Quiescent;
+            record->inUse = false;
+        }
+
+        void push(RetiredBag* first, RetiredBag* last) {
+            last->next = sealedBags.load();
+            while (!sealedBags.compare_exchange_weak(last->next, first));
+        }
+
+        // Hands the bag of the thread over to the collecting threads.
+        void seal(ThreadRecord* record) {
+            if (record->bag) {
+                push(record->bag, record->bag);
+                record->bag = nullptr;
+            }
+        }
+
+        // The global epoch can advance when no thread is still in a critical section of an older epoch.
+        void tryAdvance() {
+            auto epoch = globalEpoch.load();
+            for (auto* record = records.load(); record != nullptr; record = record->next) {
+                auto recordEpoch = record->epoch.load();
+                if (recordEpoch != Quiescent && recordEpoch != epoch)
+                    return;
+            }
+            globalEpoch.compare_exchange_strong(epoch, epoch + 1);
+        }
+
+        void freeBag(RetiredBag* bag) noexcept {
+            for (const auto& deleter: bag->deleters)
+                deleter();
+            long noBytes = 0;
+            for (auto* ptr: bag->ptrs) {
+                noBytes += static_cast<long>(Pool::blockSize(ptr));
+                Pool::free(ptr);
+            }
+            PerThread<MemoryCounters>::local().reclaimed.add(noBytes);
+            auto lag = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bag->retired).count();
+            auto max = maxLag.load();
+            while (lag > max && !maxLag.compare_exchange_weak(max, lag));
+            totalLag += lag;
+            noBagsFreed++;
+            delete bag;
+        }
 
     public:
         MemoryHandler() = default;
-        virtual ~MemoryHandler() {freeMarkedMem();}
+        MemoryHandler(const MemoryHandler&) = delete;
+        MemoryHandler& operator=(const MemoryHandler&) = delete;
+        virtual ~MemoryHandler() { // All other threads are terminated at this point.
+            for (auto* record = records.exchange(nullptr); record != nullptr;) {
+                auto* next = record->next;
+                if (record->bag)
+                    freeBag(record->bag);
+                delete record;
+                record = next;
+            }
+            for (auto* bag = sealedBags.exchange(nullptr); bag != nullptr;) {
+                auto* next = bag->next;
+                freeBag(bag);
+                bag = next;
+            }
+        }
+
+        void* allocMem(std::size_t sz, Subsystem subsystem = Subsystem::OTHER) noexcept {
+            auto* ptr = Pool::alloc(sz);
+            if (ptr)
+                PerThread<MemoryCounters>::local().allocated[subsystem].add(static_cast<long>(Pool::blockSize(ptr)));
+            return ptr;
+        }
+
+        // Critical sections may be nested. Memory retired by a thread is sealed when it leaves the outermost one.
+        void enter() noexcept {
+            auto* record = localRecord();
+            if (record->nesting++ == 0) {
+                record->epoch.exchange(globalEpoch.load()); // Visible to tryAdvance before any shared object is read.
+            }
+        }
+
+        void leave() noexcept {
+            auto* record = localRecord();
+            if (--record->nesting == 0) {
+                record->epoch.store(Quiescent, std::memory_order_release);
+                seal(record);
+                if (++record->noExits % CollectInterval == 0)
+                    freeMarkedMem();
+            }
+        }
 
-        void* allocMem(std::size_t sz) noexcept {
-            return std::malloc(sz);
+        void freeMem(void* ptr, Subsystem subsystem = Subsystem::OTHER) noexcept {
+            if (ptr == nullptr)
+                return;
+            auto noBytes = static_cast<long>(Pool::blockSize(ptr));
+            auto& counters = PerThread<MemoryCounters>::local();
+            counters.freed[subsystem].add(noBytes);
+            counters.retired.add(noBytes);
+            auto* record = localRecord();
+            if (record->bag == nullptr)
+                record->bag = new RetiredBag{0, {}, nullptr, std::chrono::steady_clock::now(), {}};
+            record->bag->ptrs.push_back(ptr);
+            record->bag->epoch = globalEpoch.load();
+            if (record->nesting == 0)
+                seal(record);
         }
 
-        void freeMem(void* ptr) noexcept {
-            std::unique_lock<std::mutex> lock(mutex);
-            markedForDeletion.push_back(ptr);
+        // Deletes the object when no thread can reach it anymore, i.e. also its destructor is deferred.
+        // Used for shared objects that are read without a lock or reference count, e.g. the subscriber snapshots.
+        template<typename T>
+        void retire(const T* obj) {
+            if (obj == nullptr)
+                return;
+            auto* record = localRecord();
+            if (record->bag == nullptr)
+                record->bag = new RetiredBag{0, {}, nullptr, std::chrono::steady_clock::now(), {}};
+            record->bag->deleters.emplace_back([obj]() {delete obj;});
+            record->bag->epoch = globalEpoch.load();
+            if (record->nesting == 0)
+                seal(record);
         }
 
+        // Frees the sealed bags that no thread can reach anymore. May be called by any thread at any time.
         void freeMarkedMem() noexcept {
-            std::unique_lock<std::mutex> lock(mutex);
-            for (auto* ptr: markedForDeletion)
-                std::free(ptr);
-            markedForDeletion.clear();
+            if (sealedBags.load() == nullptr)
+                return;
+            getUsage(); // Samples the peak usage before memory is freed.
+            tryAdvance();
+            auto epoch = globalEpoch.load();
+            RetiredBag* first = nullptr;
+            RetiredBag* last = nullptr;
+            for (auto* bag = sealedBags.exchange(nullptr); bag != nullptr;) {
+                auto* next = bag->next;
+                if (bag->epoch + 2 <= epoch)
+                    freeBag(bag);
+                else {
+                    bag->next = first;
+                    first = bag;
+                    if (last == nullptr)
+                        last = bag;
+                }
+                bag = next;
+            }
+            if (first)
+                push(first, last);
+        }
+
+        // Sums up the counters of all threads. The result is consistent enough for monitoring, not exact.
+        MemoryUsage getUsage() noexcept {
+            MemoryUsage usage;
+            long retired = 0;
+            PerThread<MemoryCounters>::forEach([&usage, &retired](const MemoryCounters& counters) {
+                for (std::size_t i = 0; i < NO_OF_SUBSYSTEMS; i++)
+                    usage.liveBytes[i] += counters.allocated[i].get() - counters.freed[i].get();
+                retired += counters.retired.get() - counters.reclaimed.get();
+            });
+            for (auto liveBytes: usage.liveBytes)
+                usage.totalLiveBytes += liveBytes;
+            usage.deferredBytes = retired;
+            auto peak = peakBytes.load();
+            while (usage.totalLiveBytes + usage.deferredBytes > peak && !peakBytes.compare_exchange_weak(peak, usage.totalLiveBytes + usage.deferredBytes));
+            usage.peakBytes = std::max(peak, usage.totalLiveBytes + usage.deferredBytes);
+            usage.reservedBytes = Pool::getReservedBytes();
+            usage.maxReclamationLag = std::chrono::microseconds(maxLag.load());
+            auto noBags = noBagsFreed.load();
+            usage.avgReclamationLag = std::chrono::microseconds(noBags > 0 ? totalLag.load() / noBags : 0);
+            return usage;
         }
     }; // MemoryHandler
 
+    // Shared by all runtimes. The pools are per thread, i.e. runtimes on different threads never contend for them.
     struct Memory
     {
-        static MemoryHandler MyMemory;
+        inline static MemoryHandler MyMemory;
 
         void* operator new(std::size_t sz) noexcept {return MyMemory.allocMem(sz);}
         void* operator new[](std::size_t sz) noexcept {return MyMemory.allocMem(sz);}
         void operator delete(void* ptr) noexcept {MyMemory.freeMem(ptr);}
         void operator delete[](void* ptr) noexcept {MyMemory.freeMem(ptr);}
         static void freeMarkedMem() noexcept {MyMemory.freeMarkedMem();}
+        template<typename T> static void retire(const T* obj) {MyMemory.retire(obj);}
+        static MemoryUsage getUsage() noexcept {return MyMemory.getUsage();}
     }; // Memory;
 
-    MemoryHandler Memory::MyMemory;
+
+    // Memory accounted for a subsystem.
+    template<Subsystem S>
+    struct SubsystemMemory: public Memory
+    {
+        void* operator new(std::size_t sz) noexcept {return MyMemory.allocMem(sz, S);}
+        void* operator new[](std::size_t sz) noexcept {return MyMemory.allocMem(sz, S);}
+        void operator delete(void* ptr) noexcept {MyMemory.freeMem(ptr, S);}
+        void operator delete[](void* ptr) noexcept {MyMemory.freeMem(ptr, S);}
+    }; // SubsystemMemory
+
+
+    // Memory deleted by other threads is not freed while the guard exists, i.e. callbacks executed
+    // within the guard may safely access the Actor, Timer or State Machine they belong to.
+    class EpochGuard
+    {
+    public:
+        EpochGuard() {Memory::MyMemory.enter();}
+        EpochGuard(const EpochGuard&) = delete;
+        EpochGuard& operator=(const EpochGuard&) = delete;
+        virtual ~EpochGuard() {Memory::MyMemory.leave();}
+    }; // EpochGuard
 } // MemoryManagement
 
 
@@ -18,12 +18,35 @@
 #ifndef CPP_ACTORS_QUEUE_H
 #define CPP_ACTORS_QUEUE_H
 #include <queue>
+#include <vector>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include "Memory.h"
 
 
 namespace Queues
 {
+    // How a consumer waits for an empty queue to be filled:
+    // BLOCKING:   Parks on the condition variable at once. Costs a futex wake-up per item pushed to an idle consumer.
+    // SPIN_PARK:  Spins for the spin time and then parks, i.e. items arriving shortly after each other cost no wake-up.
+    // SPIN_YIELD: Spins for the spin time and then yields the CPU until an item arrives. Never parks.
+    // BUSY_SPIN:  Spins until an item arrives. Never parks and never yields, i.e. burns a core for the lowest latency.
+    enum WaitStrategy {BLOCKING, SPIN_PARK, SPIN_YIELD, BUSY_SPIN};
+
+    const std::chrono::microseconds DefaultSpinTime{50};
+
+    inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+
     template<typename T>
     class Queue
     {
@@ -81,6 +104,192 @@ namespace Queues
             return queue.empty();
         }
     }; // Queue
+
+
+    // Lock-free multi-producer/single-consumer queue (D. Vyukov).
+    // push() may be called from any thread, all get functions only from the consumer thread.
+    // The consumer is only parked on the condition variable when the queue is empty.
+    template<typename T>
+    class MpscQueue
+    {
+    private:
+        struct Node: public MemoryManagement::Pooled<MemoryManagement::QUEUES>
+        {
+            std::atomic<Node*> next{nullptr};
+            T item;
+            Node() = default;
+            explicit Node(const T& item): item(item) {}
+            explicit Node(T&& item): item(std::move(item)) {}
+        };
+
+        T emptyElem;
+        alignas(64) std::atomic<Node*> head; // Producers push here.
+        alignas(64) Node* tail; // Consumer pops here. Always points to the stub node.
+        std::atomic<std::size_t> count{0};
+        std::atomic<bool> waiting{false};
+        std::atomic<WaitStrategy> waitStrategy{BLOCKING};
+        std::atomic<std::chrono::steady_clock::rep> spinTime{std::chrono::steady_clock::duration(DefaultSpinTime).count()};
+        std::mutex mutex;
+        std::condition_variable itemAvailable;
+
+        inline bool available() const {return tail->next.load() != nullptr;}
+
+        // Spins until an item is available or the deadline is reached. The time is only read every 64 rounds.
+        bool spin(std::chrono::steady_clock::time_point deadline) const {
+            for (unsigned int i = 1; !available(); i++) {
+                if (i % 64 == 0 && std::chrono::steady_clock::now() >= deadline)
+                    return false;
+                cpuRelax();
+            }
+            return true;
+        }
+
+        bool yield(std::chrono::steady_clock::time_point deadline) const {
+            while (!available()) {
+                if (std::chrono::steady_clock::now() >= deadline)
+                    return false;
+                std::this_thread::yield();
+            }
+            return true;
+        }
+
+        // A timeout of duration::max() waits forever.
+        template<typename Rep, typename Period>
+        bool wait(std::chrono::duration<Rep, Period> timeout) {
+            if (available())
+                return true;
+            auto forever = timeout == std::chrono::duration<Rep, Period>::max();
+            auto strategy = waitStrategy.load(std::memory_order_relaxed);
+            if (strategy != BLOCKING) {
+                auto start = std::chrono::steady_clock::now();
+                auto deadline = forever ? std::chrono::steady_clock::time_point::max() : start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+                auto spinDeadline = strategy == BUSY_SPIN ? deadline : std::min(deadline, start + std::chrono::steady_clock::duration(spinTime.load(std::memory_order_relaxed)));
+                if (spin(spinDeadline))
+                    return true;
+                if (strategy == SPIN_YIELD)
+                    return yield(deadline);
+                if (strategy == BUSY_SPIN || spinDeadline == deadline)
+                    return false;
+                if (!forever)
+                    timeout -= std::chrono::duration_cast<std::chrono::duration<Rep, Period>>(std::chrono::steady_clock::now() - start);
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            waiting.store(true);
+            auto isAvailable = true;
+            if (forever)
+                itemAvailable.wait(lock, [this]() {return available();});
+            else
+                isAvailable = itemAvailable.wait_for(lock, timeout, [this]() {return available();});
+            waiting.store(false);
+            return isAvailable;
+        }
+
+    public:
+        MpscQueue(): MpscQueue(T()) {};
+        explicit MpscQueue(const T emptyElem): emptyElem(emptyElem), head(new Node()), tail(head.load()) {};
+        MpscQueue(const MpscQueue<T> &) = delete;
+        MpscQueue& operator=(const MpscQueue<T>&) = delete;
+        virtual ~MpscQueue() {
+            T item;
+            while (tryGet(item));
+            delete tail;
+        }
+
+        // May be called by any thread. The consumer applies it from its next wait.
+        template<typename Rep, typename Period>
+        void setWaitStrategy(WaitStrategy strategy, std::chrono::duration<Rep, Period> spinTime) {
+            this->spinTime = std::chrono::duration_cast<std::chrono::steady_clock::duration>(spinTime).count();
+            waitStrategy = strategy;
+        }
+
+        bool tryGet(T& item) {
+            Node* next = tail->next.load(std::memory_order_acquire);
+            if (next == nullptr)
+                return false;
+            item = std::move(next->item);
+            delete tail;
+            tail = next;
+            count.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        T get() {
+            T item = emptyElem;
+            while (!tryGet(item))
+                wait(std::chrono::duration<long, std::milli>(100));
+            return item;
+        }
+
+        T get(std::chrono::duration<long, std::milli> msec) {
+            T item = emptyElem;
+            if (!tryGet(item) && wait(msec))
+                tryGet(item);
+            return item;
+        }
+
+        T get(long msec) {
+            return get(std::chrono::duration<long, std::milli>(msec));
+        }
+
+        // Waits up to timeout for the first item and then drains up to maxItems without blocking.
+        template<typename Rep, typename Period>
+        std::size_t getAll(std::vector<T>& items, std::size_t maxItems, std::chrono::duration<Rep, Period> timeout) {
+            items.clear();
+            if (!available() && !wait(timeout))
+                return 0;
+            T item;
+            while (items.size() < maxItems && tryGet(item))
+                items.push_back(std::move(item));
+            return items.size();
+        }
+
+        std::size_t getAll(std::vector<T>& items, std::size_t maxItems, long msec) {
+            return getAll(items, maxItems, std::chrono::duration<long, std::milli>(msec));
+        }
+
+        void push(const T& item) {
+            push(T(item));
+        }
+
+        void push(T&& item) {
+            auto* node = new Node(std::move(item));
+            count.fetch_add(1, std::memory_order_relaxed);
+            Node* prev = head.exchange(node);
+            prev->next.store(node);
+            if (waiting.load()) {
+                { std::unique_lock<std::mutex> lock(mutex); }
+                itemAvailable.notify_one();
+            }
+        }
+
+        // Links all items into the queue with one atomic exchange and at most one wake-up.
+        void pushAll(const std::vector<T>& items) {
+            if (items.empty())
+                return;
+            auto* first = new Node(items.front());
+            auto* last = first;
+            for (std::size_t i = 1; i < items.size(); i++) {
+                auto* node = new Node(items[i]);
+                last->next.store(node, std::memory_order_relaxed);
+                last = node;
+            }
+            count.fetch_add(items.size(), std::memory_order_relaxed);
+            Node* prev = head.exchange(last);
+            prev->next.store(first);
+            if (waiting.load()) {
+                { std::unique_lock<std::mutex> lock(mutex); }
+                itemAvailable.notify_one();
+            }
+        }
+
+        size_t size() const {
+            return count.load(std::memory_order_relaxed);
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+    }; // MpscQueue
 } // Queues
 
 #endif //CPP_ACTORS_QUEUE_H
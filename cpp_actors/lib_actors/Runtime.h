@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2023, Henrik Larsen
+ * https://github.com/henrik7264/CPP_Actors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPP_ACTORS_RUNTIME_H
+#define CPP_ACTORS_RUNTIME_H
+#include <memory>
+#include "Memory.h"
+#include "Dispatcher.h"
+#include "Scheduler.h"
+
+
+namespace Runtimes
+{
+    // A runtime owns a Dispatcher (workers and subscriptions) and a Scheduler (timer thread and workers). Actors of
+    // one runtime only exchange messages with Actors of the same runtime, and the runtimes share no threads or locks.
+    // Actors created without a runtime belong to the default runtime, i.e. Dispatcher::getInstance() and Scheduler::getInstance().
+    class Runtime
+    {
+    private:
+        std::unique_ptr<Schedulers::Scheduler> ownScheduler;
+        std::unique_ptr<Dispatchers::Dispatcher> ownDispatcher; // Deleted first, its workers execute the scheduled jobs.
+        Schedulers::Scheduler* scheduler;
+        Dispatchers::Dispatcher* dispatcher;
+
+        Runtime(Schedulers::Scheduler& scheduler, Dispatchers::Dispatcher& dispatcher): scheduler(&scheduler), dispatcher(&dispatcher) {}
+
+    public:
+        explicit Runtime(const Dispatchers::DispatcherConfig& config = Dispatchers::DispatcherConfig()):
+            ownScheduler(new Schedulers::Scheduler()),
+            ownDispatcher(new Dispatchers::Dispatcher(*ownScheduler, config)),
+            scheduler(ownScheduler.get()),
+            dispatcher(ownDispatcher.get()) {}
+        Runtime(const Runtime&) = delete;
+        Runtime& operator=(const Runtime&) = delete;
+        virtual ~Runtime() {shutdown();}
+
+        static Runtime& getDefault() {
+            static Runtime MyRuntime(Schedulers::Scheduler::getInstance(), Dispatchers::Dispatcher::getInstance());
+            return MyRuntime;
+        }
+
+        // Stops and deletes the workers and threads of the runtime. All its Actors must be deleted before.
+        // The default runtime is shut down when the program exits.
+        void shutdown() {
+            if (!ownDispatcher)
+                return; // The default runtime, or already shut down.
+            ownDispatcher.reset();
+            ownScheduler.reset();
+            dispatcher = nullptr;
+            scheduler = nullptr;
+        }
+
+        inline bool isRunning() const {return dispatcher != nullptr;}
+        inline Dispatchers::Dispatcher& getDispatcher() const {return *dispatcher;}
+        inline Schedulers::Scheduler& getScheduler() const {return *scheduler;}
+
+        // The memory pools are per thread and shared by all runtimes, i.e. the usage is that of the process.
+        static MemoryManagement::MemoryUsage getMemoryUsage() {return MemoryManagement::Memory::getUsage();}
+    }; // Runtime
+} // Runtimes
+
+#endif //CPP_ACTORS_RUNTIME_H
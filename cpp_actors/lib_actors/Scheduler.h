@@ -18,46 +18,206 @@
 
 #ifndef CPP_ACTORS_SCHEDULER_H
 #define CPP_ACTORS_SCHEDULER_H
+#include <algorithm>
 #include <cassert>
 #include <climits>
+#include <cstdint>
 #include <functional>
-#include <tuple>
-#include <list>
-#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include "Queue.h"
+#include "Memory.h"
+#include "Cpu.h"
 
 
 namespace Schedulers
 {
     typedef std::function<void()> Function_t;
     typedef unsigned long JobId_t;
-    static JobId_t NextJobId = 0;
+    typedef std::function<void(JobId_t)> JobFunction_t;
     static const JobId_t JobIdMax = ULONG_MAX;
     typedef unsigned long RepeatTimes_t;
     static const JobId_t RepeatTimesMax = ULONG_MAX;
+    static const std::size_t BatchSize = 64; // Max. number of jobs the worker drains from its queue at a time.
+    static const std::size_t NoWorker = SIZE_MAX;
+
+    typedef std::chrono::steady_clock Clock_t;
+    typedef std::uint64_t Tick_t;
+    static constexpr std::chrono::microseconds TickDuration{100}; // Resolution of the timing wheel.
+    static const Tick_t NoTick = UINT64_MAX;
+    static const unsigned int SlotBits = 8;
+    static const std::size_t NoOfSlots = 1 << SlotBits; // Per level.
+    static const std::size_t NoOfLevels = 4; // Covers 2^32 ticks. Later jobs wait in an overflow list.
+
+    typedef Queues::WaitStrategy WaitStrategy;
+    static constexpr std::chrono::milliseconds DefaultIdleInterval{100}; // An idle worker wakes up this often to free memory.
+    static constexpr Clock_t::duration NoIdleWakeUp = Clock_t::duration::max(); // An idle worker only wakes up for work.
+
+    // FIXED_RATE_BURST: The deadlines are first + n * period. Deadlines missed during a stall are executed back to back.
+    // FIXED_RATE_SKIP:  The deadlines are first + n * period. Deadlines missed during a stall are skipped.
+    // FIXED_DELAY:      The next deadline is period after the job has been executed.
+    enum RepeatMode {FIXED_RATE_BURST, FIXED_RATE_SKIP, FIXED_DELAY};
+
+    class TimerQueue;
+
+
+    // Time source of all timers. In virtual mode the time stands still until it is advanced by sleepFor(), which jumps
+    // from timeout to timeout and waits for the Actors to finish all work caused by a timeout before it jumps again,
+    // i.e. hours of timeouts are simulated in milliseconds and the timeouts are always handled at the same (virtual) time.
+    class Clock
+    {
+    private:
+        struct State
+        {
+            std::atomic<bool> isVirtual{false};
+            std::atomic<Clock_t::rep> virtualNow{0};
+            std::atomic<long> noPendingJobs{0}; // Only counted in virtual mode.
+            std::mutex queuesMutex;
+            std::vector<TimerQueue*> queues;
+        };
+
+        static State& state() {
+            static State MyState;
+            return MyState;
+        }
+
+        static bool isIdle();
+        static void advanceTo(Clock_t::time_point time);
+
+    public:
+        static inline Clock_t::time_point now() {
+            auto& s = state();
+            return s.isVirtual.load(std::memory_order_relaxed) ? Clock_t::time_point(Clock_t::duration(s.virtualNow.load())) : Clock_t::now();
+        }
+
+        // Must be called before any Actors or timers are created. The virtual time starts at the current time.
+        static void setVirtual(bool enabled) {
+            state().virtualNow = Clock_t::now().time_since_epoch().count();
+            state().isVirtual = enabled;
+        }
+
+        static inline bool isVirtual() {
+            return state().isVirtual.load(std::memory_order_relaxed);
+        }
+
+        // Jobs queued to or executed by Actors and workers. The virtual time is only advanced when there are none.
+        static inline void beginJobs(long n) {
+            if (isVirtual())
+                state().noPendingJobs += n;
+        }
+
+        static inline void endJobs(long n) {
+            if (isVirtual())
+                state().noPendingJobs -= n;
+        }
+
+        static void addQueue(TimerQueue* queue) {
+            std::unique_lock<std::mutex> lock(state().queuesMutex);
+            state().queues.push_back(queue);
+        }
+
+        static void removeQueue(TimerQueue* queue) {
+            std::unique_lock<std::mutex> lock(state().queuesMutex);
+            auto& queues = state().queues;
+            queues.erase(std::remove(queues.begin(), queues.end(), queue), queues.end());
+        }
+
+        // Sleeps the calling thread. In virtual mode the virtual time is advanced instead, and the function returns when
+        // all timeouts up to the new time have been handled. Only one thread, e.g. the main thread of a test, may advance it.
+        template<typename Rep, typename Period>
+        static void sleepFor(std::chrono::duration<Rep, Period> duration) {
+            if (isVirtual())
+                advanceTo(now() + std::chrono::duration_cast<Clock_t::duration>(duration));
+            else
+                std::this_thread::sleep_for(duration);
+        }
+    }; // Clock
+
+
+    // Jobs executed together by one thread, e.g. the expired jobs a worker takes from its queue in one wake-up.
+    // Functions deferred by the jobs are called when the outermost batch of the thread ends, e.g. the Dispatcher
+    // hands the mailboxes that expired jobs post to over to its workers in one operation instead of one per job.
+    class JobBatch
+    {
+    private:
+        static int& depth() {
+            static thread_local int depth = 0;
+            return depth;
+        }
+
+        static std::vector<Function_t>& deferred() {
+            static thread_local std::vector<Function_t> funcs;
+            return funcs;
+        }
+
+    public:
+        JobBatch() {depth()++;}
+        JobBatch(const JobBatch&) = delete;
+        JobBatch& operator=(const JobBatch&) = delete;
+        ~JobBatch() {
+            if (--depth() == 0)
+                flush();
+        }
+
+        static inline bool isActive() {return depth() > 0;}
+
+        // Must only be called while a batch is active.
+        static void defer(Function_t func) {
+            deferred().push_back(std::move(func));
+        }
+
+        // Calls the deferred functions now, e.g. before the thread waits for something they may be needed for.
+        static void flush() {
+            std::vector<Function_t> funcs;
+            while (!deferred().empty()) {
+                funcs.swap(deferred());
+                for (const auto& func: funcs)
+                    func();
+                funcs.clear();
+            }
+        }
+    }; // JobBatch
+
 
     class Worker
     {
     private:
-        bool doLoop = true;
+        std::atomic<bool> doLoop{true};
+        std::atomic<Clock_t::rep> idleInterval{Clock_t::duration(DefaultIdleInterval).count()};
         std::thread trd;
-        Queues::Queue <Function_t> jobQueue{nullptr};
+        Queues::MpscQueue<Function_t> jobQueue{nullptr};
 
         void run()
         {
+            std::vector<Function_t> funcs;
+            funcs.reserve(BatchSize);
             while (doLoop) {
-                auto func = jobQueue.get(100);
-                if (doLoop && func)
-                    func();
+                auto interval = Clock_t::duration(idleInterval.load());
+                if (interval == NoIdleWakeUp && jobQueue.empty())
+                    MemoryManagement::Memory::freeMarkedMem(); // The worker may be parked for good.
+                if (jobQueue.getAll(funcs, BatchSize, interval) == 0) { // funcs is empty if the queue times out.
+                    MemoryManagement::Memory::freeMarkedMem();
+                    continue;
+                }
+                MemoryManagement::EpochGuard guard; // Timers and Actors deleted while the jobs run are not freed until they return.
+                JobBatch batch;
+                for (const auto& func: funcs)
+                    if (func) { // null entries are only used to wake up the worker.
+                        if (doLoop)
+                            func();
+                        Clock::endJobs(1);
+                    }
             }
         }
 
         void stop() {
             doLoop = false;
+            jobQueue.push(nullptr);
             if (trd.joinable())
                 trd.join();
         }
@@ -66,110 +226,557 @@ namespace Schedulers
         Worker() { trd = std::thread([this]() { run(); }); }
         virtual ~Worker() { stop(); }
 
-        inline Queues::Queue <Function_t>& getQueue() { return jobQueue; }
+        template<typename Rep, typename Period>
+        void setWaitStrategy(WaitStrategy strategy, std::chrono::duration<Rep, Period> spinTime, Clock_t::duration idleInterval) {
+            jobQueue.setWaitStrategy(strategy, spinTime);
+            this->idleInterval = idleInterval.count();
+            jobQueue.push(nullptr); // A parked worker applies the new idle interval at once.
+        }
+
+        bool setAffinity(const Cpus::CpuSet_t& cpus) {
+            return Cpus::pin(trd, cpus);
+        }
+
+        inline Queues::MpscQueue<Function_t>& getQueue() { return jobQueue; }
     }; // Worker
 
 
-    class Scheduler
+    // Log2 histogram of durations. Bucket 0 counts durations below 1 us and bucket i durations in [2^(i-1), 2^i) us.
+    struct Histogram
+    {
+        static const std::size_t NoOfBuckets = 24; // The last bucket also counts all durations above 4 s.
+        std::uint32_t buckets[NoOfBuckets] = {};
+        std::uint64_t count = 0;
+        Clock_t::duration total = Clock_t::duration::zero();
+        Clock_t::duration max = Clock_t::duration::zero();
+
+        void add(Clock_t::duration duration) {
+            auto usec = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+            std::size_t bucket = usec == 0 ? 0 : 64 - static_cast<std::size_t>(__builtin_clzll(usec));
+            buckets[bucket < NoOfBuckets ? bucket : NoOfBuckets - 1]++;
+            count++;
+            total += duration;
+            if (duration > max)
+                max = duration;
+        }
+
+        Clock_t::duration mean() const {
+            return count == 0 ? Clock_t::duration::zero() : total / static_cast<Clock_t::rep>(count);
+        }
+
+        // Upper bound of the bucket that contains the percentile (0-100), i.e. at most twice the exact value.
+        Clock_t::duration percentile(double percent) const {
+            std::uint64_t sum = 0;
+            for (std::size_t i = 0; i < NoOfBuckets - 1; i++) {
+                sum += buckets[i];
+                if (count > 0 && sum >= percent / 100.0 * count)
+                    return std::min<Clock_t::duration>(std::chrono::microseconds(std::uint64_t(1) << i), max);
+            }
+            return max;
+        }
+    }; // Histogram
+
+
+    // Lateness is the time from the deadline of a job until it expires, i.e. until it is handed to a worker or mailbox.
+    // Jitter is the difference between the lateness of two consecutive executions.
+    struct JobStats
+    {
+        Histogram lateness;
+        Histogram jitter;
+        std::uint64_t noOfSkipped = 0; // Deadlines skipped by FIXED_RATE_SKIP jobs.
+        Clock_t::duration lastLateness = Clock_t::duration::zero();
+
+        void add(Clock_t::duration late) {
+            if (late < Clock_t::duration::zero())
+                late = Clock_t::duration::zero();
+            if (lateness.count > 0)
+                jitter.add(late > lastLateness ? late - lastLateness : lastLateness - late);
+            lateness.add(late);
+            lastLateness = late;
+        }
+    }; // JobStats
+
+
+    struct Job: public MemoryManagement::Pooled<MemoryManagement::TIMERS>
+    {
+        JobId_t jobId;
+        Function_t func;
+        Clock_t::time_point timeout;
+        Clock_t::duration period;
+        RepeatTimes_t repeatTimes;
+        RepeatMode mode;
+        Clock_t::duration slack = Clock_t::duration::zero(); // Tolerated delay of the timeouts.
+        bool armed = false; // In the timing wheel. FIXED_DELAY jobs are not armed while they are executed.
+        std::unique_ptr<JobStats> stats; // Only recorded for repeated jobs.
+        Tick_t tick = 0; // Timeout in ticks of the timing wheel.
+        std::size_t level = 0;
+        std::size_t slot = 0;
+        std::size_t worker = NoWorker; // Chosen by the owner when the job expires the first time.
+        Job* prev = nullptr;
+        Job* next = nullptr;
+
+        Job(JobId_t jobId, Clock_t::time_point timeout, Clock_t::duration period, RepeatTimes_t repeatTimes, RepeatMode mode):
+            jobId(jobId), timeout(timeout), period(period), repeatTimes(repeatTimes), mode(mode), stats(repeatTimes > 1 ? new JobStats() : nullptr) {}
+    }; // Job
+
+
+    // Hierarchical timing wheel. Level L has NoOfSlots slots of NoOfSlots^L ticks each. A job is placed in the lowest
+    // level whose current rotation contains its timeout, and is moved one or more levels down (cascaded) when its slot
+    // is reached. Insert and remove are O(1), expiry is O(1) amortized, and empty slots are skipped by means of bitmaps.
+    class TimingWheel
     {
     private:
-        bool doLoop = true;
-        std::thread trd;
+        Job* slots[NoOfLevels + 1][NoOfSlots] = {}; // The last level only uses slot 0 (overflow).
+        std::uint64_t bitmaps[NoOfLevels][NoOfSlots / 64] = {};
+        Tick_t currentTick = 0;
+
+        static inline Tick_t rotation(Tick_t tick, std::size_t level) {
+            auto shift = SlotBits * (level + 1);
+            return shift < 64 ? tick >> shift : 0;
+        }
+
+        static inline std::size_t slotOf(Tick_t tick, std::size_t level) {
+            return (tick >> (SlotBits * level)) & (NoOfSlots - 1);
+        }
+
+        // Returns the first non-empty slot after slot at the level, or NoOfSlots.
+        std::size_t nextSlot(std::size_t level, std::size_t slot) const {
+            for (auto i = slot + 1; i < NoOfSlots;) {
+                auto word = bitmaps[level][i / 64] >> (i % 64);
+                if (word)
+                    return i + static_cast<std::size_t>(__builtin_ctzll(word));
+                i = (i / 64 + 1) * 64;
+            }
+            return NoOfSlots;
+        }
+
+        void link(Job* job, std::size_t level, std::size_t slot) {
+            job->level = level;
+            job->slot = slot;
+            job->prev = nullptr;
+            job->next = slots[level][slot];
+            if (job->next)
+                job->next->prev = job;
+            slots[level][slot] = job;
+            if (level < NoOfLevels)
+                bitmaps[level][slot / 64] |= std::uint64_t(1) << (slot % 64);
+        }
+
+        void place(Job* job) {
+            for (std::size_t level = 0; level < NoOfLevels; level++)
+                if (rotation(job->tick, level) == rotation(currentTick, level)) {
+                    link(job, level, slotOf(job->tick, level));
+                    return;
+                }
+            link(job, NoOfLevels, 0);
+        }
+
+        Job* takeSlot(std::size_t level, std::size_t slot) {
+            auto* jobs = slots[level][slot];
+            slots[level][slot] = nullptr;
+            if (level < NoOfLevels)
+                bitmaps[level][slot / 64] &= ~(std::uint64_t(1) << (slot % 64));
+            return jobs;
+        }
+
+    public:
+        TimingWheel() = default;
+        TimingWheel(const TimingWheel&) = delete;
+        TimingWheel& operator=(const TimingWheel&) = delete;
+        virtual ~TimingWheel() = default;
+
+        inline Tick_t getCurrentTick() const {return currentTick;}
+
+        // Jobs that are already due expire at the next tick.
+        void insert(Job* job) {
+            if (job->tick <= currentTick)
+                job->tick = currentTick + 1;
+            place(job);
+        }
+
+        void remove(Job* job) {
+            if (job->prev)
+                job->prev->next = job->next;
+            else {
+                slots[job->level][job->slot] = job->next;
+                if (job->next == nullptr && job->level < NoOfLevels)
+                    bitmaps[job->level][job->slot / 64] &= ~(std::uint64_t(1) << (job->slot % 64));
+            }
+            if (job->next)
+                job->next->prev = job->prev;
+            job->prev = job->next = nullptr;
+        }
+
+        // The next tick at which a job expires or must be cascaded. NoTick if the wheel is empty.
+        Tick_t nextTick() const {
+            for (std::size_t level = 0; level < NoOfLevels; level++) {
+                auto slot = nextSlot(level, slotOf(currentTick, level));
+                if (slot < NoOfSlots)
+                    return (rotation(currentTick, level) << (SlotBits * (level + 1))) | (Tick_t(slot) << (SlotBits * level));
+            }
+            return slots[NoOfLevels][0] ? (rotation(currentTick, NoOfLevels - 1) + 1) << (SlotBits * NoOfLevels) : NoTick;
+        }
+
+        // Advances the wheel to tick. Expired jobs are removed from the wheel and handed to onExpired.
+        template<typename Function>
+        void advance(Tick_t tick, const Function& onExpired) {
+            for (auto next = nextTick(); next <= tick; next = nextTick()) {
+                currentTick = next;
+                for (auto level = NoOfLevels; level > 0; level--) // Cascade from the top, starting with the overflow list.
+                    if ((next & ((Tick_t(1) << (SlotBits * level)) - 1)) == 0)
+                        for (auto* job = takeSlot(level, level == NoOfLevels ? 0 : slotOf(next, level)); job != nullptr;) {
+                            auto* nextJob = job->next;
+                            place(job);
+                            job = nextJob;
+                        }
+                for (auto* job = takeSlot(0, slotOf(next, 0)); job != nullptr;) {
+                    auto* nextJob = job->next;
+                    job->prev = job->next = nullptr;
+                    onExpired(job);
+                    job = nextJob;
+                }
+            }
+            if (tick > currentTick)
+                currentTick = tick;
+        }
+    }; // TimingWheel
+
+
+    // Jobs of one timing wheel and the functions to add, change and remove them. The owner thread sleeps until
+    // the next tick (plannedTick), advances the wheel and executes the functions of the expired jobs.
+    class TimerQueue
+    {
+        friend class Clock;
+
+    private:
+        JobId_t nextJobId = 0;
+
+        // A job with slack expires at the next multiple of the largest power of two ticks within its slack,
+        // i.e. jobs with similar slack expire at the same ticks and are handled by one wake-up.
+        void arm(Job* job) {
+            job->tick = tickOf(job->timeout);
+            auto slackTicks = static_cast<Tick_t>(job->slack / TickDuration);
+            if (slackTicks > 1) {
+                auto granule = Tick_t(1) << (63 - __builtin_clzll(slackTicks));
+                job->tick = (job->tick + granule - 1) & ~(granule - 1);
+            }
+            job->armed = true;
+            wheel.insert(job);
+            if (job->tick < plannedTick)
+                wakeUp(job->tick);
+        }
+
+        void expired(Job* job, Clock_t::time_point now) {
+            job->armed = false;
+            if (job->stats)
+                job->stats->add(now - job->timeout);
+            if (doLoop) {
+                Clock::beginJobs(1);
+                execute(job);
+            }
+            if (job->repeatTimes != RepeatTimesMax)
+                job->repeatTimes--;
+            if (job->repeatTimes == 0) {
+                jobs.erase(job->jobId);
+                delete job;
+            }
+            else if (job->mode != FIXED_DELAY) { // FIXED_DELAY jobs are armed again by rearm().
+                if (job->mode == FIXED_RATE_SKIP && job->period > Clock_t::duration::zero() && now >= job->timeout + job->period) {
+                    auto noMissed = (now - job->timeout) / job->period;
+                    job->timeout += noMissed * job->period;
+                    job->stats->noOfSkipped += noMissed;
+                }
+                job->timeout += job->period;
+                arm(job);
+            }
+        }
+
+        JobId_t add(Clock_t::duration period, const JobFunction_t& func, RepeatTimes_t repeatTimes, RepeatMode mode) {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto jobId = nextJobId++;
+            auto* job = new Job(jobId, Clock::now() + period, period, repeatTimes, mode);
+            job->func = [jobId, func]() {func(jobId);};
+            jobs[jobId] = job;
+            arm(job);
+            return jobId;
+        }
+
+    protected:
+        std::atomic<bool> doLoop{true}; // Written by stop() of the owner, read by its thread without the mutex.
         std::mutex mutex;
+        std::unordered_map<JobId_t, Job*> jobs;
+        TimingWheel wheel;
+        Clock_t::time_point epoch = Clock::now(); // Tick 0 of the wheel.
+        Tick_t plannedTick = NoTick; // The tick the owner thread sleeps until.
+
+        inline Tick_t tickOf(Clock_t::time_point time) const { // Rounded up, i.e. a job never expires early.
+            return time <= epoch ? 0 : static_cast<Tick_t>((time - epoch + TickDuration - Clock_t::duration(1)) / TickDuration);
+        }
+
+        inline Clock_t::time_point timeOf(Tick_t tick) const {
+            return epoch + tick * TickDuration;
+        }
+
+        // Called while holding the mutex when a job is armed to expire before plannedTick.
+        virtual void wakeUp(Tick_t tick) = 0;
+
+        // Called while holding the mutex for each expired job. A job is never executed concurrently with itself.
+        // The owner must call Clock::endJobs(1) when the job has been executed.
+        virtual void execute(Job* job) = 0;
+
+        // Called when the virtual time has been advanced. The owner must advance the wheel to the new time.
+        virtual void timeChanged() = 0;
+
+        // Must be called while holding the mutex.
+        void advance(Clock_t::time_point now) {
+            wheel.advance(now <= epoch ? 0 : static_cast<Tick_t>((now - epoch) / TickDuration), [this, now](Job* job) {expired(job, now);});
+        }
+
+    public:
+        TimerQueue() {Clock::addQueue(this);}
+        TimerQueue(const TimerQueue&) = delete;
+        TimerQueue& operator=(const TimerQueue&) = delete;
+        virtual ~TimerQueue() {
+            Clock::removeQueue(this);
+            for (auto& job: jobs)
+                delete job.second;
+            jobs.clear();
+        }
+
+        template<typename Rep, typename Period>
+        JobId_t onceIn(std::chrono::duration<Rep, Period> timeout, const Function_t& func) {
+            return add(std::chrono::duration_cast<Clock_t::duration>(timeout), [func](JobId_t) {func();}, 1, FIXED_RATE_BURST);
+        }
+
+        JobId_t onceIn(long msec, const Function_t& func) {
+            return onceIn(std::chrono::duration<long, std::milli>(msec), func);
+        }
+
+        // Periods below 1 ms are supported down to the resolution of the timing wheel (TickDuration).
+        template<typename Rep, typename Period>
+        JobId_t repeatEvery(std::chrono::duration<Rep, Period> period, const Function_t& func, RepeatMode mode = FIXED_RATE_BURST) {
+            if (mode == FIXED_DELAY)
+                return repeatAfter(period, [this, func](JobId_t jobId) {func(); rearm(jobId);});
+            return add(std::chrono::duration_cast<Clock_t::duration>(period), [func](JobId_t) {func();}, RepeatTimesMax, mode);
+        }
+
+        JobId_t repeatEvery(long msec, const Function_t& func, RepeatMode mode = FIXED_RATE_BURST) {
+            return repeatEvery(std::chrono::duration<long, std::milli>(msec), func, mode);
+        }
+
+        // FIXED_DELAY job of which the work is completed by another thread, e.g. an Actor. func gets the id of the job,
+        // and rearm(jobId) must be called when the work is done. The job is not executed again until then.
+        template<typename Rep, typename Period>
+        JobId_t repeatAfter(std::chrono::duration<Rep, Period> delay, const JobFunction_t& func) {
+            return add(std::chrono::duration_cast<Clock_t::duration>(delay), func, RepeatTimesMax, FIXED_DELAY);
+        }
+
+        void rearm(const JobId_t jobId) {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto job = jobs.find(jobId);
+            if (job != jobs.end() && !job->second->armed && doLoop) {
+                job->second->timeout = Clock::now() + job->second->period;
+                arm(job->second);
+            }
+        }
+
+        // Allows the timeouts of the job to be delayed up to slack, so that timeouts of many jobs can be handled together.
+        template<typename Rep, typename Period>
+        void setSlack(const JobId_t jobId, std::chrono::duration<Rep, Period> slack) {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto job = jobs.find(jobId);
+            if (job != jobs.end()) {
+                job->second->slack = std::chrono::duration_cast<Clock_t::duration>(slack);
+                if (job->second->armed) {
+                    wheel.remove(job->second);
+                    arm(job->second);
+                }
+            }
+        }
+
+        void removeJob(const JobId_t jobId) {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto job = jobs.find(jobId);
+            if (job != jobs.end()) {
+                if (job->second->armed)
+                    wheel.remove(job->second);
+                delete job->second;
+                jobs.erase(job);
+            }
+        }
+
+        // The time of the next tick at which a job expires or is cascaded, Clock_t::time_point::max() if there are no jobs.
+        Clock_t::time_point getNextTimeout() {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto tick = wheel.nextTick();
+            return tick == NoTick ? Clock_t::time_point::max() : timeOf(tick);
+        }
+
+        // Lateness and jitter of a repeated job. Empty if the job is unknown or not repeated.
+        JobStats getStats(const JobId_t jobId) {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto job = jobs.find(jobId);
+            return job != jobs.end() && job->second->stats ? *job->second->stats : JobStats();
+        }
+    }; // TimerQueue
+
+
+    // The scheduler thread advances the wheel and hands the expired jobs to the scheduler workers.
+    class Scheduler: public TimerQueue
+    {
+    private:
+        std::thread trd;
         std::condition_variable jobAvailable;
-        std::map<JobId_t, std::tuple<Function_t, std::chrono::steady_clock::time_point, std::chrono::duration<long,std::milli>, RepeatTimes_t>> jobs;
-        Worker* worker = new Worker();
+        std::vector<Worker*> workers{new Worker()};
         std::size_t noWorkers = 1;
+        std::vector<std::vector<Function_t>> expiredFuncs; // Per worker. Handed over in one batch per wake-up.
+        WaitStrategy waitStrategy = WaitStrategy::BLOCKING;
+        Clock_t::duration spinTime = Queues::DefaultSpinTime;
+        Clock_t::duration idleInterval = DefaultIdleInterval;
+        Cpus::CpuSet_t cpus;
+
+        void wakeUp(Tick_t) override {
+            jobAvailable.notify_one();
+        }
+
+        void timeChanged() override {
+            { std::unique_lock<std::mutex> lock(mutex); }
+            jobAvailable.notify_one();
+        }
+
+        void execute(Job* job) override {
+            if (noWorkers == 0)
+                return;
+            if (job->worker == NoWorker) // Kept when workers are added, i.e. a job is always executed by the same worker.
+                job->worker = job->jobId % noWorkers;
+            expiredFuncs[job->worker].push_back(job->func);
+        }
 
         void run() {
+            std::unique_lock<std::mutex> lock(mutex);
             while (doLoop) {
-                std::unique_lock<std::mutex> lock(mutex);
-                while (doLoop && jobs.empty())
+                plannedTick = wheel.nextTick();
+                if (plannedTick == NoTick)
                     jobAvailable.wait(lock);
-
-                auto nextTimeout = std::chrono::time_point<std::chrono::steady_clock>::max();
-                for (auto job: jobs) {
-                    auto jobTimeout = std::get<1>(job.second);
-                    auto jobRepeatTimes = std::get<3>(job.second);
-                    if ((jobRepeatTimes > 0) && (jobTimeout < nextTimeout))
-                        nextTimeout = jobTimeout;
+                else if (Clock::isVirtual()) { // The virtual time is not related to the time of the condition variable.
+                    if (timeOf(plannedTick) > Clock::now()) // The time may have been advanced before the thread started.
+                        jobAvailable.wait(lock);
                 }
-                if (doLoop && (nextTimeout > std::chrono::steady_clock::now()))
-                    jobAvailable.wait_until(lock, nextTimeout);
-
-                std::list<JobId_t> jobsToRemove;
-                auto currentTime = std::chrono::steady_clock::now();
-                for (auto job: jobs) {
-                    auto jobId = job.first;
-                    auto func = std::get<0>(job.second);
-                    auto jobTimeout = std::get<1>(job.second);
-                    auto jobDuration = std::get<2>(job.second);
-                    auto jobRepeatTimes = std::get<3>(job.second);
-
-                    if (doLoop && (noWorkers > 0) && (jobRepeatTimes > 0) && (jobTimeout <= currentTime)) {
-                        worker->getQueue().push(func);
-                        if (jobRepeatTimes == 1)
-                            jobsToRemove.push_back(jobId);
-                        else
-                            jobs[jobId] = std::make_tuple(func, jobTimeout + jobDuration, jobDuration, jobRepeatTimes-1);
+                else
+                    jobAvailable.wait_until(lock, timeOf(plannedTick));
+                plannedTick = 0; // Jobs added while the wheel is advanced need no wake-up.
+                expiredFuncs.resize(noWorkers);
+                advance(Clock::now());
+                for (std::size_t i = 0; i < expiredFuncs.size(); i++)
+                    if (!expiredFuncs[i].empty()) {
+                        workers[i]->getQueue().pushAll(expiredFuncs[i]);
+                        expiredFuncs[i].clear();
                     }
-                }
-                for (auto jobId: jobsToRemove)
-                    jobs.erase(jobId);
             }
         }
 
         void stop() {
-            doLoop = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                doLoop = false;
+            }
             jobAvailable.notify_one();
             if (trd.joinable())
                 trd.join();
         }
 
+    public:
+        // The Scheduler of the default runtime is returned by getInstance(), other runtimes create their own.
         Scheduler() {trd = std::thread([this]() {run();});}
-        virtual ~Scheduler() {
+        ~Scheduler() override {
             stop();
-            delete worker;
             noWorkers = 0;
+            for (auto* worker: workers)
+                delete worker;
+            workers.clear();
         }
 
-    public:
         static Scheduler& getInstance() {
             static Scheduler MyScheduler;
             return MyScheduler;
         }
 
-        JobId_t onceIn(std::chrono::duration<long, std::milli> msec, const Function_t& func) {
+        // Jobs of Actors, Timers and State Machines are executed by the Dispatcher workers, the scheduler workers
+        // only hand them over. Other jobs are executed by the scheduler workers. Workers are never removed.
+        // A job keeps the worker it first expired on, i.e. the workers should be added before the jobs are scheduled.
+        void setNoOfWorkers(std::size_t n) {
             std::unique_lock<std::mutex> lock(mutex);
-            auto jobId = NextJobId++;
-            jobs[jobId] = std::make_tuple(func, std::chrono::steady_clock::now()+msec, msec, 1);
-            jobAvailable.notify_one();
-            return jobId;
+            while (doLoop && workers.size() < n) {
+                workers.push_back(new Worker());
+                workers.back()->setWaitStrategy(waitStrategy, spinTime, idleInterval);
+                if (!cpus.empty())
+                    workers.back()->setAffinity(cpus);
+            }
+            noWorkers = workers.size();
         }
 
-        JobId_t onceIn(long msec, const Function_t& func) {
-            return onceIn(std::chrono::duration<long, std::milli>(msec), func);
+        // How idle scheduler workers wait for jobs, see Queues::WaitStrategy. An idle worker also wakes up every
+        // idleInterval to free memory. With NoIdleWakeUp it frees the memory before it parks and then only wakes up for jobs.
+        template<typename Rep, typename Period>
+        void setWaitStrategy(WaitStrategy strategy, std::chrono::duration<Rep, Period> spinTime = Queues::DefaultSpinTime, Clock_t::duration idleInterval = DefaultIdleInterval) {
+            std::unique_lock<std::mutex> lock(mutex);
+            this->waitStrategy = strategy;
+            this->spinTime = std::chrono::duration_cast<Clock_t::duration>(spinTime);
+            this->idleInterval = idleInterval;
+            for (auto* worker: workers)
+                worker->setWaitStrategy(strategy, spinTime, idleInterval);
         }
 
-        JobId_t repeatEvery(std::chrono::duration<long, std::milli> msec, const std::function<void()>& func) {
-            std::unique_lock<std::mutex> lock(mutex);
-            auto jobId = NextJobId++;
-            jobs[jobId] = std::make_tuple(func, std::chrono::steady_clock::now()+msec, msec, RepeatTimesMax);
-            jobAvailable.notify_one();
-            return jobId;
+        void setWaitStrategy(WaitStrategy strategy) {
+            setWaitStrategy(strategy, Queues::DefaultSpinTime);
         }
 
-        JobId_t repeatEvery(long msec, const Function_t& func) {
-            return repeatEvery(std::chrono::duration<long, std::milli>(msec), func);
+        // Pins the scheduler thread and workers to the CPUs, e.g. to keep them away from the Dispatcher workers.
+        bool setAffinity(const Cpus::CpuSet_t& cpus) {
+            std::unique_lock<std::mutex> lock(mutex);
+            this->cpus = cpus;
+            auto pinned = Cpus::pin(trd, cpus);
+            for (auto* worker: workers)
+                pinned = worker->setAffinity(cpus) && pinned;
+            return pinned;
         }
 
-        void removeJob(const JobId_t jobId) {
+        std::size_t getNoOfWorkers() {
             std::unique_lock<std::mutex> lock(mutex);
-            if (jobs.find(jobId) != jobs.end()) {
-                jobs.erase(jobId);
-                jobAvailable.notify_one();
-            }
+            return noWorkers;
         }
     }; // Scheduler
+
+
+    // All timeouts are handled and all Actors are idle.
+    inline bool Clock::isIdle() {
+        if (state().noPendingJobs.load() != 0)
+            return false;
+        auto time = now();
+        std::unique_lock<std::mutex> lock(state().queuesMutex);
+        for (auto* queue: state().queues)
+            if (queue->getNextTimeout() <= time)
+                return false;
+        return true;
+    }
+
+    inline void Clock::advanceTo(Clock_t::time_point time) {
+        for (;;) {
+            while (!isIdle())
+                std::this_thread::yield();
+            auto next = Clock_t::time_point::max();
+            {
+                std::unique_lock<std::mutex> lock(state().queuesMutex);
+                for (auto* queue: state().queues)
+                    next = std::min(next, queue->getNextTimeout());
+            }
+            state().virtualNow = std::min(next, time).time_since_epoch().count();
+            if (next > time)
+                return;
+            std::unique_lock<std::mutex> lock(state().queuesMutex);
+            for (auto* queue: state().queues)
+                queue->timeChanged();
+        }
+    }
 } // Schedulers
 #endif //CPP_ACTORS_SCHEDULER_H
@@ -20,10 +20,13 @@
 
 #include <cassert>
 #include <memory>
+#include <atomic>
 #include <functional>
 #include <mutex>
+#include <limits>
 #include <list>
 #include <map>
+#include <vector>
 #include <utility>
 #include "Memory.h"
 #include "Message.h"
@@ -51,8 +54,6 @@ namespace StateMachines
     typedef LongWrapper NextState;
     typedef LongWrapper Initial_State;
 
-    class StateMachine;
-
 
     enum VarArgType {STATE_VA, TIMER_VA, MESSAGE_VA};
     class VarArg
@@ -71,15 +72,13 @@ namespace StateMachines
     class Transition: public VarArg
     {
     protected:
-        static std::mutex transition_lock;
-        StateMachine* stateMachine;
         NextState nextState;
 
     public:
-        explicit Transition(VarArgType type, const NextState& nextState): VarArg(type), stateMachine(nullptr), nextState(nextState) {}
+        explicit Transition(VarArgType type, const NextState& nextState): VarArg(type), nextState(nextState) {}
         ~Transition() override = default;
 
-        void setStateMachine(StateMachine* sm) {stateMachine = sm;}
+        inline NextState getNextState() const {return nextState;}
     }; // Transition
 
 
@@ -96,7 +95,7 @@ namespace StateMachines
         ~MessageTransition() override = default;
 
         inline Message_t getMsgType() const {return msgType;}
-        void doAction(Message* msg);
+        inline void doAction(Message* msg) {action(msg);}
     }; // MessageTransition
 
 
@@ -116,7 +115,7 @@ namespace StateMachines
         ~TimerTransition() override = default;
 
         inline Timeout getTimeout() const {return timeout;}
-        void doAction();
+        inline void doAction() {action();}
     }; // TimerTransition
 
 
@@ -141,123 +140,178 @@ namespace StateMachines
                 delete arg;
         }
 
-        void setStateMachine(StateMachine* stateMachine) {
-            for (auto arg: args) {
-                auto trans = dynamic_cast<Transition*>(arg);
-                trans->setStateMachine(stateMachine);
-            }
-        }
-
         inline StateId getStateId() const {return stateId;}
         inline const std::list<VarArg*>& getTransitions() const {return args;}
     }; // State
 
 
-    class StateMachine: public MemoryManagement::Memory
+    // The transitions are compiled into tables when the State Machine is created: One row per state id and one column
+    // per message type used by any of the states. Each message type is subscribed once for the lifetime of the State
+    // Machine, i.e. a transition is a table lookup and a store of the next state. Only the timers of a state are
+    // scheduled when it is entered.
+    class StateMachine: public MemoryManagement::SubsystemMemory<MemoryManagement::STATE_MACHINES>
     {
     private:
+        static constexpr std::size_t Stay = std::numeric_limits<std::size_t>::max(); // The transition has no next state.
+
+        struct MessageEntry
+        {
+            MessageTransition* transition = nullptr; // nullptr: The message is ignored in the state.
+            std::size_t nextRow = Stay;
+        };
+
+        struct TimerEntry
+        {
+            TimerTransition* transition;
+            std::size_t nextRow;
+        };
+
         bool markedForDeletion;
-        std::mutex& actorMutex;
+        Dispatchers::ActorContext& context;
         std::mutex mutex;
-        StateId currState;
         std::list<VarArg*> args; // list of states
+        std::vector<long> stateIds; // [row] Includes the ids of next states that are not defined, i.e. without transitions.
+        std::size_t noOfColumns = 0;
+        std::vector<MessageEntry> table; // [row * noOfColumns + column]
+        std::vector<std::vector<TimerEntry>> timers; // [row]
+        std::size_t currRow = 0;
+        unsigned long entered = 0; // Counts the entered states. Timeouts of a state that has been left are ignored.
         std::list<JobId_t> jobs;
         std::list<std::pair<SubscriptionId_t, Message_t>> subscriptions;
+        std::shared_ptr<std::atomic<bool>> alive = std::make_shared<std::atomic<bool>>(true); // Outlives the State Machine in queued callbacks.
 
-    public:
-        template<typename ... States>
-        explicit StateMachine(std::mutex& actorMutex, const Initial_State& initialState,  States... states) : markedForDeletion(false), actorMutex(actorMutex), currState(initialState), args({states...}) {
-            jobs.clear();
-            subscriptions.clear();
+        std::size_t rowOf(long stateId) const {
+            for (std::size_t row = 0; row < stateIds.size(); row++)
+                if (stateIds[row] == stateId)
+                    return row;
+            return Stay;
+        }
+
+        std::size_t addRow(long stateId) {
+            auto row = rowOf(stateId);
+            if (row != Stay)
+                return row;
+            stateIds.push_back(stateId);
+            return stateIds.size() - 1;
+        }
+
+        void compile(const Initial_State& initialState) {
+            std::vector<State*> states;
+            std::map<Message_t, std::size_t> columns;
             for (auto arg: args) {
                 assert(arg->getVarArcType() == VarArgType::STATE_VA);
                 auto* state = dynamic_cast<State*>(arg);
-                state->setStateMachine(this);
+                assert(rowOf(state->getStateId()) == Stay); // State ids must be unique.
+                addRow(state->getStateId());
+                states.push_back(state);
+                for (auto* trans: state->getTransitions())
+                    if (trans->getVarArcType() == VarArgType::MESSAGE_VA) {
+                        auto msgType = dynamic_cast<MessageTransition*>(trans)->getMsgType();
+                        if (columns.find(msgType) == columns.end()) {
+                            auto column = columns.size();
+                            columns[msgType] = column;
+                        }
+                    }
             }
-            setCurrState(initialState);
+            for (auto* state: states)
+                for (auto* trans: state->getTransitions()) {
+                    auto nextState = dynamic_cast<Transition*>(trans)->getNextState();
+                    if (nextState != UNDEFINED_STATE)
+                        addRow(nextState);
+                }
+            currRow = addRow(initialState);
+
+            noOfColumns = columns.size();
+            table.resize(stateIds.size() * noOfColumns);
+            timers.resize(stateIds.size());
+            for (std::size_t row = 0; row < states.size(); row++)
+                for (auto* trans: states[row]->getTransitions()) {
+                    auto nextState = dynamic_cast<Transition*>(trans)->getNextState();
+                    auto nextRow = nextState != UNDEFINED_STATE ? rowOf(nextState) : Stay;
+                    if (trans->getVarArcType() == VarArgType::TIMER_VA)
+                        timers[row].push_back(TimerEntry{dynamic_cast<TimerTransition*>(trans), nextRow});
+                    if (trans->getVarArcType() == VarArgType::MESSAGE_VA) {
+                        auto* msgTrans = dynamic_cast<MessageTransition*>(trans);
+                        auto& entry = table[row * noOfColumns + columns[msgTrans->getMsgType()]];
+                        assert(entry.transition == nullptr); // One transition per message type and state.
+                        entry = MessageEntry{msgTrans, nextRow};
+                    }
+                }
+
+            enter(currRow);
+            for (const auto& column: columns)
+                subscriptions.emplace_back(context.getDispatcher().registerCB([this, alive = alive, index = column.second](Message* msg) {
+                    if (*alive)
+                        handle(index, msg);}, column.first, context.getMailbox()), column.first);
+        }
+
+        // Removes the timers of the current state and schedules the timers of the next state.
+        void enter(std::size_t row) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (markedForDeletion)
+                return;
+            for (auto job: jobs)
+                context.getTimers().removeJob(job);
+            jobs.clear();
+            currRow = row;
+            auto count = ++entered;
+            auto mailbox = context.getMailbox();
+            for (std::size_t index = 0; index < timers[row].size(); index++)
+                jobs.push_back(context.getTimers().onceIn(timers[row][index].transition->getTimeout(), [this, mailbox, alive = alive, count, index] () {
+                    mailbox->postExpired([this, alive, count, index]() {
+                        if (*alive)
+                            timeout(count, index);});}));
+        }
+
+        void handle(std::size_t column, Message* msg) {
+            auto lock = context.lock(); // Not needed when the mailbox serializes the transitions.
+            if (markedForDeletion)
+                return;
+            const auto& entry = table[currRow * noOfColumns + column];
+            if (entry.transition == nullptr)
+                return;
+            entry.transition->doAction(msg);
+            if (entry.nextRow != Stay)
+                enter(entry.nextRow);
+        }
+
+        void timeout(unsigned long count, std::size_t index) {
+            auto lock = context.lock(); // Not needed when the mailbox serializes the transitions.
+            if (markedForDeletion || count != entered)
+                return;
+            const auto& entry = timers[currRow][index];
+            entry.transition->doAction();
+            if (entry.nextRow != Stay)
+                enter(entry.nextRow);
+        }
+
+    public:
+        template<typename ... States>
+        explicit StateMachine(Dispatchers::ActorContext& context, const Initial_State& initialState,  States... states) : markedForDeletion(false), context(context), args({states...}) {
+            compile(initialState);
         }
 
         template<typename ... States>
-        explicit StateMachine(std::mutex& actorMutex, long initialState, States... states): StateMachine(actorMutex, Initial_State(initialState), states...) {}
+        explicit StateMachine(Dispatchers::ActorContext& context, long initialState, States... states): StateMachine(context, Initial_State(initialState), states...) {}
 
         virtual ~StateMachine() {
             std::unique_lock<std::mutex> lock(mutex);
+            *alive = false;
             markedForDeletion = true;
             for (auto job: jobs)
-                Schedulers::Scheduler::getInstance().removeJob(job);
+                context.getTimers().removeJob(job);
             jobs.clear();
             for (auto subs: subscriptions)
-                Dispatchers::Dispatcher::getInstance().unregisterCB(subs.first, subs.second);
+                context.getDispatcher().unregisterCB(subs.first, subs.second);
             subscriptions.clear();
             for (auto arg: args)
                 delete arg;
         }
 
         inline bool getMarkedForDeletion() const {return markedForDeletion;}
-        inline std::mutex& getActorMutex() {return actorMutex;}
-        inline StateId& getCurrentState() {return currState;}
-
-        void setCurrState(const StateId& currentState) {
-            std::unique_lock<std::mutex> lock(mutex);
-            if (!markedForDeletion) {
-                for (auto job: jobs)
-                    Schedulers::Scheduler::getInstance().removeJob(job);
-                jobs.clear();
-                for (auto subs: subscriptions)
-                    Dispatchers::Dispatcher::getInstance().unregisterCB(subs.first, subs.second);
-                subscriptions.clear();
-
-                currState = currentState;
-
-                for (auto arg: args) {
-                    auto* state = dynamic_cast<State*>(arg);
-                    if (state->getStateId() == currState) {
-                        for (auto* trans: state->getTransitions()) {
-                            if (trans->getVarArcType() == VarArgType::TIMER_VA) {
-                                auto* timerTrans = dynamic_cast<TimerTransition*>(trans);
-                                jobs.push_back(Schedulers::Scheduler::getInstance().onceIn(timerTrans->getTimeout(), [timerTrans] () {timerTrans->doAction();}));
-                            }
-                            if (trans->getVarArcType() == VarArgType::MESSAGE_VA) {
-                                auto* msgTrans = dynamic_cast<MessageTransition*>(trans);
-                                auto msgType = msgTrans->getMsgType();
-                                subscriptions.emplace_back(Dispatchers::Dispatcher::getInstance().registerCB([msgTrans](Message* msg) {msgTrans->doAction(msg);}, msgType), msgType);
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        inline Dispatchers::ActorContext& getContext() {return context;}
+        inline StateId getCurrentState() const {return StateId(stateIds[currRow]);}
     }; // StateMachine
-
-    std::mutex Transition::transition_lock;
-
-    void MessageTransition::doAction(Message* msg) {
-        if (!stateMachine->getMarkedForDeletion()) {
-            auto currState = stateMachine->getCurrentState();
-            std::unique_lock<std::mutex> lock(transition_lock);
-            if (currState == stateMachine->getCurrentState()) {
-                std::unique_lock<std::mutex> lock2(stateMachine->getActorMutex());
-                action(msg);
-                lock2.unlock();
-                if (nextState != UNDEFINED_STATE)
-                    stateMachine->setCurrState(nextState);
-            }
-        }
-    }
-
-    void TimerTransition::doAction() {
-        if (!stateMachine->getMarkedForDeletion()) {
-            auto currState = stateMachine->getCurrentState();
-            std::unique_lock<std::mutex> lock(transition_lock);
-            if (currState == stateMachine->getCurrentState()) {
-                std::unique_lock<std::mutex> lock2(stateMachine->getActorMutex());
-                action();
-                lock2.unlock();
-                if (nextState != UNDEFINED_STATE)
-                    stateMachine->setCurrState(nextState);
-            }
-        }
-    }
 } // StateMachines
 
 #endif //CPP_ACTORS_STATEMACHINE_H
@@ -19,59 +19,115 @@
 #define CPP_ACTORS_TIMER_H
 
 #include <chrono>
+#include <memory>
+#include <atomic>
 #include <mutex>
 #include <functional>
+#include <limits>
 #include <utility>
 #include "Memory.h"
+#include "Dispatcher.h"
 #include "Scheduler.h"
 
 
 namespace Timers
 {
-    class Timer: public MemoryManagement::Memory
+    // start() only stores a new deadline, i.e. restarting a running Timer never touches the Scheduler. At most one
+    // scheduler job is pending per Timer. When it expires it compares the deadline with the current time, and is
+    // scheduled again for the remaining time if the Timer has been restarted in the meantime.
+    class Timer: public MemoryManagement::SubsystemMemory<MemoryManagement::TIMERS>
     {
     private:
-        bool markedForDeletion;
-        std::mutex& actorMutex;
-        std::mutex timerMutex;
-        Schedulers::JobId_t jobId;
+        typedef Schedulers::Clock_t::rep Stamp_t;
+        static constexpr Stamp_t Stopped = std::numeric_limits<Stamp_t>::min();
+
+        // Shared with the pending scheduler job, i.e. it outlives the Timer.
+        struct State
+        {
+            std::mutex mutex;
+            std::atomic<Stamp_t> deadline{Stopped};
+            std::atomic<bool> pending{false}; // A scheduler job is pending. Only set while holding the mutex.
+            bool alive = true;
+            Schedulers::JobId_t jobId = Schedulers::JobIdMax;
+            Schedulers::Clock_t::duration slack = Schedulers::Clock_t::duration::zero();
+        };
+
+        Dispatchers::ActorContext& context;
         std::chrono::duration<long, std::milli> msec;
         Schedulers::Function_t func;
+        std::shared_ptr<State> state = std::make_shared<State>();
+        std::shared_ptr<std::atomic<bool>> alive = std::make_shared<std::atomic<bool>>(true); // Outlives the Timer in posted callbacks.
+
+        static inline Stamp_t now() {return Schedulers::Clock::now().time_since_epoch().count();}
 
         void timeout() {
-            std::unique_lock<std::mutex> lock(actorMutex);
-            if (!markedForDeletion)
-                func();
+            context.post([this, alive = alive]() {
+                if (*alive)
+                    func();});
         }
 
-        void stopTimer() {
-            if (jobId != Schedulers::JobIdMax) {
-                Schedulers::Scheduler::getInstance().removeJob(jobId);
-                jobId = Schedulers::JobIdMax;
+        // Must be called while holding the mutex of the state.
+        void schedule(Stamp_t delay) {
+            auto& timers = context.getTimers();
+            state->pending = true;
+            state->jobId = timers.onceIn(Schedulers::Clock_t::duration(delay), [this, state = state]() {expired(state);});
+            if (state->slack > Schedulers::Clock_t::duration::zero())
+                timers.setSlack(state->jobId, state->slack);
+        }
+
+        void expired(const std::shared_ptr<State>& state) {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            if (!state->alive)
+                return;
+            state->pending = false; // Before the deadline is read, i.e. a concurrent start() either sees it or is seen below.
+            state->jobId = Schedulers::JobIdMax;
+            for (auto deadline = state->deadline.load(); deadline != Stopped;) {
+                auto time = now();
+                if (time < deadline) {
+                    schedule(deadline - time);
+                    return;
+                }
+                if (state->deadline.compare_exchange_weak(deadline, Stopped)) {
+                    timeout();
+                    return;
+                }
             }
         }
 
     public:
-        Timer(std::mutex& actorMutex, std::chrono::duration<long, std::milli> msec, Schedulers::Function_t func): markedForDeletion(false), actorMutex(actorMutex), jobId(Schedulers::JobIdMax), msec(msec), func(std::move(func)) {}
-        Timer(std::mutex& actorMutex, long msec, const Schedulers::Function_t& func): Timer(actorMutex, std::chrono::duration<long, std::milli>(msec), func) {}
+        Timer(Dispatchers::ActorContext& context, std::chrono::duration<long, std::milli> msec, Schedulers::Function_t func): context(context), msec(msec), func(std::move(func)) {}
+        Timer(Dispatchers::ActorContext& context, long msec, const Schedulers::Function_t& func): Timer(context, std::chrono::duration<long, std::milli>(msec), func) {}
         virtual ~Timer() {
-            std::unique_lock<std::mutex> lock(actorMutex);
-            markedForDeletion = true;
-            stopTimer();
+            auto lock = context.lock();
+            *alive = false;
+            std::unique_lock<std::mutex> stateLock(state->mutex);
+            state->alive = false;
+            if (state->jobId != Schedulers::JobIdMax)
+                context.getTimers().removeJob(state->jobId);
         }
 
+        // The pending scheduler job, if any, is discarded when it expires.
         void stop() {
-            std::unique_lock<std::mutex> lock(timerMutex);
-            stopTimer();
+            state->deadline = Stopped;
         }
 
+        // Lock-free unless no scheduler job is pending, i.e. unless the Timer was stopped or has timed out.
         void start() {
-            std::unique_lock<std::mutex> lock(timerMutex);
-            if (!markedForDeletion) {
-                stopTimer();
-                jobId = Schedulers::Scheduler::getInstance().onceIn(msec, [this](){timeout();});
+            auto delay = std::chrono::duration_cast<Schedulers::Clock_t::duration>(msec).count();
+            state->deadline = now() + delay;
+            if (!state->pending) {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                if (!state->pending && state->alive)
+                    schedule(delay);
             }
         }
+
+        // The timeout may be delayed up to slack, so that it can be handled together with other timeouts. Applied from the next start.
+        template<typename Rep, typename Period>
+        void setSlack(std::chrono::duration<Rep, Period> slack) {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->slack = std::chrono::duration_cast<Schedulers::Clock_t::duration>(slack);
+        }
     }; // Timer
 } // Timers
 
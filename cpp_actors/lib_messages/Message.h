@@ -17,23 +17,177 @@
 
 #ifndef CPP_ACTORS_MESSAGE_H
 #define CPP_ACTORS_MESSAGE_H
+#include <cassert>
 #include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include "MessageTypes.h"
+#include "Memory.h"
 
 
 namespace Messages
 {
+    static const unsigned int MaxNoOfTypedMsgs = 256;
+    static const unsigned int MaxNoOfMsgTypes = Message_t::NO_OF_MSG_TYPES + 1 + MaxNoOfTypedMsgs;
+
+    // Number of messages per type, counted per thread.
+    struct MsgCounters
+    {
+        MemoryManagement::Counter created[MaxNoOfMsgTypes];
+        MemoryManagement::Counter deleted[MaxNoOfMsgTypes];
+
+        static void count(Message_t type, bool created) {
+            if (type < MaxNoOfMsgTypes) {
+                auto& counters = MemoryManagement::PerThread<MsgCounters>::local();
+                (created ? counters.created[type] : counters.deleted[type]).add(1);
+            }
+        }
+    };
+
+    struct MsgUsage
+    {
+        long live = 0; // Created and not yet deleted, i.e. queued, in flight or retained.
+        long created = 0;
+    };
+
+    // A published message is shared (not copied) by all subscribers and is deleted when the last reference is released.
+    // A subscriber that wants to keep a message after its callback returns simply holds a MessagePtr to it.
     class Message
     {
     private:
         Message_t msgType;
+        mutable std::atomic<unsigned long> refCount{0};
 
     public:
-        explicit Message(Message_t type): msgType(type) {}
-        virtual ~Message() = default;
+        explicit Message(Message_t type): msgType(type) {MsgCounters::count(msgType, true);}
+        Message(const Message& msg): msgType(msg.msgType) {MsgCounters::count(msgType, true);} // A copy is a new message with its own references.
+        Message& operator=(const Message& msg) {
+            MsgCounters::count(msgType, false);
+            msgType = msg.msgType;
+            MsgCounters::count(msgType, true);
+            return *this;
+        }
+        virtual ~Message() {MsgCounters::count(msgType, false);}
 
         Message_t getMsgType() const {return msgType;}
+
+        inline void retain() const {refCount.fetch_add(1, std::memory_order_relaxed);}
+        inline void release() const {
+            if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete this;
+        }
     }; // Message
+
+
+    template<typename T = Message>
+    class MessagePtr
+    {
+    private:
+        T* msg = nullptr;
+
+        template<typename U> friend class MessagePtr;
+
+    public:
+        MessagePtr() = default;
+        MessagePtr(T* msg): msg(msg) {if (msg) msg->retain();}
+        MessagePtr(const MessagePtr& ptr): msg(ptr.msg) {if (msg) msg->retain();}
+        MessagePtr(MessagePtr&& ptr) noexcept: msg(ptr.msg) {ptr.msg = nullptr;}
+        template<typename U>
+        MessagePtr(const MessagePtr<U>& ptr): msg(ptr.msg) {if (msg) msg->retain();}
+        ~MessagePtr() {if (msg) msg->release();}
+
+        MessagePtr& operator=(MessagePtr ptr) noexcept {std::swap(msg, ptr.msg); return *this;}
+
+        inline T* get() const {return msg;}
+        inline T* operator->() const {return msg;}
+        inline T& operator*() const {return *msg;}
+        explicit operator bool() const {return msg != nullptr;}
+    }; // MessagePtr
+
+    typedef MessagePtr<Message> MessagePtr_t;
+
+
+    // Messages derived from PooledMessage are allocated from a thread local pool instead of the heap.
+    // They may be freed by any thread.
+    class PooledMessage: public Message, public MemoryManagement::Pooled<MemoryManagement::MESSAGES>
+    {
+    public:
+        explicit PooledMessage(Message_t type): Message(type) {}
+        ~PooledMessage() override = default;
+    }; // PooledMessage
+
+
+    // Allocates any message class derived from Message from the message pool, i.e. the class
+    // need not be derived from PooledMessage.
+    template<typename M>
+    class EmplacedMsg final: public M, public MemoryManagement::Pooled<MemoryManagement::MESSAGES>
+    {
+    public:
+        using MemoryManagement::Pooled<MemoryManagement::MESSAGES>::operator new;
+        using MemoryManagement::Pooled<MemoryManagement::MESSAGES>::operator delete;
+
+        template<typename ... Args>
+        explicit EmplacedMsg(Args&&... args): M(std::forward<Args>(args)...) {}
+        ~EmplacedMsg() override = default;
+    }; // EmplacedMsg
+
+
+    // Typed messages need no entry in Message_t. Each type is given a dense message type (id) after NO_OF_MSG_TYPES
+    // the first time it is used, i.e. the dispatcher routes them exactly like the enumerated messages.
+    inline MsgUsage getMsgUsage(Message_t type) {
+        MsgUsage usage;
+        if (type < MaxNoOfMsgTypes)
+            MemoryManagement::PerThread<MsgCounters>::forEach([&usage, type](const MsgCounters& counters) {
+                usage.created += counters.created[type].get();
+                usage.live += counters.created[type].get() - counters.deleted[type].get();
+            });
+        return usage;
+    }
+
+    inline bool isValidMsgType(Message_t type) {
+        return type != Message_t::NONE && type != Message_t::NO_OF_MSG_TYPES && type < MaxNoOfMsgTypes;
+    }
+
+    inline Message_t nextTypedMsgType() {
+        static std::atomic<unsigned int> nextType{Message_t::NO_OF_MSG_TYPES + 1};
+        auto type = static_cast<Message_t>(nextType++);
+        if (type >= MaxNoOfMsgTypes) // The tables of the Dispatcher are indexed by the type, also in release builds.
+            throw std::length_error("Too many typed message types - increase MaxNoOfTypedMsgs.");
+        return type;
+    }
+
+    template<typename T>
+    inline Message_t msgTypeOf() {
+        static const Message_t type = nextTypedMsgType();
+        return type;
+    }
+
+
+    // Carries a value of any type T. Subscribers of T get a const reference to the value - no dynamic_cast is needed.
+    template<typename T>
+    class TypedMsg: public PooledMessage
+    {
+    private:
+        T value;
+
+    public:
+        template<typename ... Args>
+        explicit TypedMsg(Args&&... args): PooledMessage(msgTypeOf<T>()), value(std::forward<Args>(args)...) {}
+        ~TypedMsg() override = default;
+
+        inline const T& get() const {return value;}
+    }; // TypedMsg
+
+
+    // Creates a message of type T in the message pool. T may be a subclass of Message or any other type (typed message).
+    template<typename T, typename ... Args>
+    inline Message* newPooledMsg(Args&&... args) {
+        typedef std::conditional_t<!std::is_base_of<Message, T>::value, TypedMsg<T>,
+                std::conditional_t<std::is_base_of<PooledMessage, T>::value, T, EmplacedMsg<T>>> PooledMsg_t;
+        return new PooledMsg_t(std::forward<Args>(args)...);
+    }
 } // Messages
 
 #endif //CPP_ACTORS_MESSAGE_H
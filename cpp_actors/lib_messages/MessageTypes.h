@@ -22,7 +22,7 @@
 
 namespace Messages
 {
-    enum Message_t
+    enum Message_t: unsigned int // Fixed underlying type as typed messages (see Message.h) are numbered after NO_OF_MSG_TYPES.
     {
         NONE, // Don't remove or rename. NONE shall always be the first element.
         PUB_SUB, // Used in example publish subscriber.